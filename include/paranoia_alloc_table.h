@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Maps the (page-aligned) start address of each buffer to its metadata.
+//
+// This is an open-addressing hash table with linear probing, keyed by page
+// number.  All of the records live in one contiguous array, so a lookup is
+// usually a single cache miss, and insert / erase don't touch the heap except
+// when the table has to grow.
+template <typename V>
+class ParanoiaAllocTable {
+    public:
+        explicit ParanoiaAllocTable(size_t page_size, size_t initial_capacity = 1024);
+
+        // Returns nullptr if 'addr' isn't a key in the table.
+        // The returned pointer is invalidated by the next insert(...) or erase(...).
+        V* find(const void* addr);
+        const V* find(const void* addr) const;
+
+        // 'addr' must not already be a key in the table.
+        V& insert(const void* addr, const V& value);
+
+        // Returns false if 'addr' isn't a key in the table.
+        bool erase(const void* addr);
+
+        size_t size() const;
+        bool empty() const;
+
+        // Calls f(value) for each value in the table, in no particular order.
+        template <typename F>
+            void for_each(F f) const;
+
+    private:
+        struct Slot {
+            uintptr_t page_num; // 0 indicates an empty slot.
+            V value;
+        };
+
+        std::vector<Slot> slots_;
+        size_t num_used_ = 0;
+
+        unsigned page_shift_ = 0;
+        unsigned slot_shift_ = 0; // 64 - log2(slots_.size())
+
+        uintptr_t page_num_of(const void* addr) const;
+        size_t home_slot(uintptr_t page_num) const;
+        size_t find_slot(uintptr_t page_num) const;
+        void rehash(size_t new_capacity);
+};
+
+static inline unsigned paranoia_log2(size_t x)
+{
+    unsigned n = 0;
+    while (x > 1) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+}
+
+template <typename V>
+ParanoiaAllocTable<V>::ParanoiaAllocTable(size_t page_size, size_t initial_capacity)
+    : page_shift_(paranoia_log2(page_size))
+{
+    assert((page_size & (page_size - 1)) == 0);
+    assert((initial_capacity & (initial_capacity - 1)) == 0);
+    assert(initial_capacity > 1);
+
+    rehash(initial_capacity);
+}
+
+template <typename V>
+uintptr_t ParanoiaAllocTable<V>::page_num_of(const void* addr) const
+{
+    const uintptr_t page_num = reinterpret_cast<uintptr_t>(addr) >> page_shift_;
+    assert(page_num != 0);
+    return page_num;
+}
+
+template <typename V>
+size_t ParanoiaAllocTable<V>::home_slot(uintptr_t page_num) const
+{
+    // Fibonacci hashing: the multiply spreads runs of consecutive page numbers
+    // across the table, and the high bits are the well-mixed ones.
+    return size_t((uint64_t(page_num) * UINT64_C(0x9E3779B97F4A7C15)) >> slot_shift_);
+}
+
+template <typename V>
+size_t ParanoiaAllocTable<V>::find_slot(uintptr_t page_num) const
+{
+    const size_t mask = slots_.size() - 1;
+
+    for (size_t i = home_slot(page_num); ; i = (i + 1) & mask) {
+        const uintptr_t slot_page_num = slots_[i].page_num;
+        if ((slot_page_num == page_num) || (slot_page_num == 0)) {
+            return i;
+        }
+    }
+}
+
+template <typename V>
+V* ParanoiaAllocTable<V>::find(const void* addr)
+{
+    const uintptr_t page_num = page_num_of(addr);
+    Slot & slot = slots_[find_slot(page_num)];
+    return (slot.page_num == page_num) ? &slot.value : nullptr;
+}
+
+template <typename V>
+const V* ParanoiaAllocTable<V>::find(const void* addr) const
+{
+    const uintptr_t page_num = page_num_of(addr);
+    const Slot & slot = slots_[find_slot(page_num)];
+    return (slot.page_num == page_num) ? &slot.value : nullptr;
+}
+
+template <typename V>
+V& ParanoiaAllocTable<V>::insert(const void* addr, const V& value)
+{
+    // Keep the load factor at or below 1/2, so probe sequences stay short.
+    if (2 * (num_used_ + 1) > slots_.size()) {
+        rehash(2 * slots_.size());
+    }
+
+    const uintptr_t page_num = page_num_of(addr);
+    Slot & slot = slots_[find_slot(page_num)];
+    assert(slot.page_num == 0);
+
+    slot.page_num = page_num;
+    slot.value = value;
+    ++num_used_;
+
+    return slot.value;
+}
+
+template <typename V>
+bool ParanoiaAllocTable<V>::erase(const void* addr)
+{
+    const uintptr_t page_num = page_num_of(addr);
+    size_t i = find_slot(page_num);
+    if (slots_[i].page_num != page_num) {
+        return false;
+    }
+
+    // Backward-shift deletion: pull later members of the probe run into the
+    // hole, so that lookups never need tombstones.
+    const size_t mask = slots_.size() - 1;
+
+    for (size_t j = (i + 1) & mask; slots_[j].page_num != 0; j = (j + 1) & mask) {
+        const size_t k = home_slot(slots_[j].page_num);
+
+        // Leave slot 'j' alone if its home lies cyclically within (i, j].
+        const bool stays = (i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j));
+        if (! stays) {
+            slots_[i] = slots_[j];
+            i = j;
+        }
+    }
+
+    slots_[i].page_num = 0;
+    --num_used_;
+
+    return true;
+}
+
+template <typename V>
+size_t ParanoiaAllocTable<V>::size() const
+{
+    return num_used_;
+}
+
+template <typename V>
+bool ParanoiaAllocTable<V>::empty() const
+{
+    return num_used_ == 0;
+}
+
+template <typename V>
+template <typename F>
+void ParanoiaAllocTable<V>::for_each(F f) const
+{
+    for (const Slot & slot : slots_) {
+        if (slot.page_num != 0) {
+            f(slot.value);
+        }
+    }
+}
+
+template <typename V>
+void ParanoiaAllocTable<V>::rehash(size_t new_capacity)
+{
+    std::vector<Slot> old_slots(new_capacity, Slot{0, V()});
+    old_slots.swap(slots_);
+
+    slot_shift_ = 64 - paranoia_log2(new_capacity);
+
+    for (const Slot & old_slot : old_slots) {
+        if (old_slot.page_num != 0) {
+            Slot & slot = slots_[find_slot(old_slot.page_num)];
+            slot = old_slot;
+        }
+    }
+}
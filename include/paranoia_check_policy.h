@@ -0,0 +1,64 @@
+#pragma once
+
+// Compile-time checking policies for paranoid_vector.
+//
+// Every policy except paranoia_passthrough quarantines replaced buffers and
+// keeps spare capacity PROT_NONE; they differ only in what they check at
+// runtime.
+
+// operator[] is bounds-checked, just like at().
+struct paranoia_full_checks {
+    static constexpr bool check_index = true;
+    static constexpr bool check_concurrency = false;
+    static constexpr bool check_iterators = false;
+};
+
+// operator[] is unchecked, like std::vector's, so hot loops over it can be
+// vectorized.  Stale buffers are still caught by the quarantine.
+struct paranoia_quarantine_only {
+    static constexpr bool check_index = false;
+    static constexpr bool check_concurrency = false;
+    static constexpr bool check_iterators = false;
+};
+
+// Adds concurrent-misuse detection to another policy, e.g.
+// paranoia_concurrency_checks<paranoia_quarantine_only>.  Each mutating call
+// claims the vector with one atomic compare-exchange, and aborts with a
+// diagnostic if another thread is part-way through mutating it.  Const access
+// isn't checked, and costs nothing extra.
+template <typename BasePolicy>
+struct paranoia_concurrency_checks : BasePolicy {
+    static constexpr bool check_concurrency = true;
+};
+
+// Makes iterators checked objects instead of raw pointers, on top of another
+// policy.  Each iterator records its vector's generation, which the vector
+// bumps whenever its elements move to another buffer; dereferencing a stale
+// iterator aborts with a diagnostic.  This catches iterator invalidation
+// without relying on the quarantine, so the pool's quarantine budget (see
+// ParanoiaPool::set_preferred_max_bytes) can be kept small.  Raw pointers
+// from data() and &v[i] are still only caught by the quarantine.
+template <typename BasePolicy>
+struct paranoia_checked_iterators : BasePolicy {
+    static constexpr bool check_iterators = true;
+};
+
+// No paranoia at all: paranoid_vector_t<T> is plain std::vector<T>.
+struct paranoia_passthrough {
+};
+
+// The build-wide default, e.g. -DPARANOIA_DEFAULT_CHECK_POLICY=paranoia_quarantine_only
+// for optimized builds.
+#ifndef PARANOIA_DEFAULT_CHECK_POLICY
+#define PARANOIA_DEFAULT_CHECK_POLICY paranoia_full_checks
+#endif
+
+// Specialize this to pick a different policy for particular element types:
+//
+//     template <> struct paranoia_check_policy_for<float> {
+//         using type = paranoia_passthrough;
+//     };
+template <typename T>
+struct paranoia_check_policy_for {
+    using type = PARANOIA_DEFAULT_CHECK_POLICY;
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+
+// Shared by a paranoid_vector and the checked iterators into it (see
+// paranoia_checked_iterators in paranoia_check_policy.h).  The vector bumps
+// 'generation' whenever its elements move to another buffer, which
+// invalidates every iterator made before then.
+//
+// Blocks are never freed: a destroyed vector's block is recycled for a later
+// vector, with its generation still counting up, so iterators into the
+// destroyed vector stay detectably stale without keeping anything else alive.
+struct ParanoiaIteratorControl {
+    std::atomic<uint64_t> generation{0};
+    ParanoiaIteratorControl* next_free = nullptr;
+
+    void invalidate_iterators() {
+        generation.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+ParanoiaIteratorControl* paranoia_acquire_iterator_control();
+
+// Also invalidates all of its iterators.
+void paranoia_release_iterator_control(ParanoiaIteratorControl* control);
+
+// Prints a diagnostic and aborts.
+[[noreturn]] void paranoia_report_stale_iterator(
+        const void* p,
+        uint64_t iterator_generation,
+        uint64_t current_generation);
+
+// A random-access iterator over 'T' (const or not) that checks, with a single
+// compare, that its vector hasn't reallocated since the iterator was made.
+// Only dereferencing is checked; arithmetic and comparisons aren't.
+template <typename T>
+class paranoia_checked_iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type        = typename std::remove_cv<T>::type;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = T*;
+        using reference         = T&;
+
+        paranoia_checked_iterator() = default;
+
+        paranoia_checked_iterator(const ParanoiaIteratorControl* control, T* p)
+            : control_(control),
+              generation_(control->generation.load(std::memory_order_relaxed)),
+              p_(p)
+        {
+        }
+
+        // iterator to const_iterator.
+        template <typename U,
+                  typename = typename std::enable_if<std::is_same<const U, T>::value && ! std::is_const<U>::value>::type>
+            paranoia_checked_iterator(const paranoia_checked_iterator<U> & other)
+            : control_(other.control_),
+              generation_(other.generation_),
+              p_(other.p_)
+        {
+        }
+
+        reference operator*() const { return *get(); }
+        pointer operator->() const { return get(); }
+        reference operator[](difference_type n) const { return get()[n]; }
+
+        paranoia_checked_iterator & operator++() { ++p_; return *this; }
+        paranoia_checked_iterator & operator--() { --p_; return *this; }
+        paranoia_checked_iterator operator++(int) { paranoia_checked_iterator x = *this; ++p_; return x; }
+        paranoia_checked_iterator operator--(int) { paranoia_checked_iterator x = *this; --p_; return x; }
+
+        paranoia_checked_iterator & operator+=(difference_type n) { p_ += n; return *this; }
+        paranoia_checked_iterator & operator-=(difference_type n) { p_ -= n; return *this; }
+
+        paranoia_checked_iterator operator+(difference_type n) const { paranoia_checked_iterator x = *this; x.p_ += n; return x; }
+        paranoia_checked_iterator operator-(difference_type n) const { paranoia_checked_iterator x = *this; x.p_ -= n; return x; }
+
+        friend paranoia_checked_iterator operator+(difference_type n, const paranoia_checked_iterator & i) { return i + n; }
+
+        // The address, after checking that it's still valid.
+        T* get() const {
+            const uint64_t current = control_->generation.load(std::memory_order_relaxed);
+            if (current != generation_) {
+                paranoia_report_stale_iterator(p_, generation_, current);
+            }
+            return p_;
+        }
+
+        // The address, unchecked.
+        T* base() const { return p_; }
+
+    private:
+        template <typename U> friend class paranoia_checked_iterator;
+
+        const ParanoiaIteratorControl* control_ = nullptr;
+        uint64_t generation_ = 0;
+        T* p_ = nullptr;
+};
+
+template <typename T, typename U>
+std::ptrdiff_t operator-(const paranoia_checked_iterator<T> & a, const paranoia_checked_iterator<U> & b) {
+    return a.base() - b.base();
+}
+
+template <typename T, typename U>
+bool operator==(const paranoia_checked_iterator<T> & a, const paranoia_checked_iterator<U> & b) {
+    return a.base() == b.base();
+}
+
+template <typename T, typename U>
+bool operator!=(const paranoia_checked_iterator<T> & a, const paranoia_checked_iterator<U> & b) {
+    return a.base() != b.base();
+}
+
+template <typename T, typename U>
+bool operator<(const paranoia_checked_iterator<T> & a, const paranoia_checked_iterator<U> & b) {
+    return a.base() < b.base();
+}
+
+template <typename T, typename U>
+bool operator>(const paranoia_checked_iterator<T> & a, const paranoia_checked_iterator<U> & b) {
+    return a.base() > b.base();
+}
+
+template <typename T, typename U>
+bool operator<=(const paranoia_checked_iterator<T> & a, const paranoia_checked_iterator<U> & b) {
+    return a.base() <= b.base();
+}
+
+template <typename T, typename U>
+bool operator>=(const paranoia_checked_iterator<T> & a, const paranoia_checked_iterator<U> & b) {
+    return a.base() >= b.base();
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// A small process-wide set of worker threads, for splitting up bulk work on
+// very large buffers (see ParanoiaPool::set_parallel_min_bytes).  The workers
+// are only started the first time they're needed.
+
+// Calls fn(i) for each i in [0, num_tasks), spread over the workers and the
+// calling thread, and returns once every call has returned.  'fn' must not
+// throw.  Safe to call concurrently, from any thread.
+void paranoia_parallel_for(size_t num_tasks, const std::function<void(size_t)> & fn);
+
+// Threads that share the work of paranoia_parallel_for, including the caller.
+size_t paranoia_parallel_num_threads();
+
+const size_t PARANOIA_MAX_PARALLEL_THREADS = 8;
+
+// Work is never split into pieces smaller than this.
+const size_t PARANOIA_PARALLEL_MIN_CHUNK_BYTES = 1024 * 1024;
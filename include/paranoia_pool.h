@@ -1,25 +1,216 @@
 #pragma once
 
+#include "paranoia_alloc_table.h"
+#include "paranoia_stats.h"
+
 #include <sys/mman.h>
+#include <pthread.h>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <deque>
 #include <map>
-#include <queue>
+#include <mutex>
 #include <memory>
+#include <thread>
+#include <vector>
 
+// All public methods are safe to call concurrently, from any thread.  The
+// pool's state is sharded (see 'Shard' below), so allocate / deallocate take
+// only the mutex of the shard concerned; there's no pool-wide lock on those
+// paths.  A buffer may be deallocated by a different thread than the one that
+// allocated it.
 class ParanoiaPool {
     public:
         ParanoiaPool(size_t preferred_max_bytes, size_t preferred_max_allocs);
         virtual ~ParanoiaPool();
 
-        void* allocate(size_t num_bytes, int initial_prot = PROT_READ | PROT_WRITE);
+        // Only the first 'num_prefix_bytes' (rounded up to whole pages) get
+        // 'initial_prot'; the rest of the allocation starts out PROT_NONE.
+        void* allocate(
+                size_t num_bytes,
+                int initial_prot = PROT_READ | PROT_WRITE,
+                size_t num_prefix_bytes = SIZE_MAX);
+
         void deallocate(void* p);
+
+        // Moves allocation 'p' to a new address range of 'num_bytes' (rounded up
+        // to whole pages, and no smaller than the allocation), and returns the
+        // new address.  The accessible pages are moved with mremap rather than
+        // copied, so this costs page-table updates instead of memory bandwidth.
+        // The old range is quarantined, exactly as if 'p' had been passed to
+        // deallocate.
+        //
+        // The new allocation keeps p's protection.  Its accessible prefix is the
+        // larger of p's and 'num_prefix_bytes' (rounded up to whole pages); the
+        // added pages read as zero.
+        void* grow_by_remap(void* p, size_t num_bytes, size_t num_prefix_bytes);
+
+        // Below this, copying is about as cheap as remapping, so callers may as
+        // well allocate and copy as usual.
+        static const size_t REMAP_MIN_BYTES = 64 * 1024;
+
         void set_prot(void* p, int prot);
         int get_prot(void* p);
 
+        // Gives the first 'num_bytes' of the allocation, rounded up to whole pages,
+        // protection 'prot', and makes the remaining pages PROT_NONE.
+        // Only the pages whose protection actually changes are passed to mprotect.
+        // Returns the size of the accessible prefix, in bytes.
+        size_t set_prot_prefix(void* p, size_t num_bytes, int prot);
+
+        static size_t get_page_size();
+
+        // A batch of protection changes and deallocations, to be applied by
+        // ParanoiaPool::apply(...) with as few syscalls as possible:
+        // - When a plan touches the same buffer more than once, only its final
+        //   state is applied.  (A deallocation trumps everything else.)
+        // - Adjacent page ranges going to the same protection are coalesced into
+        //   a single mprotect.
+        class ProtPlan {
+            public:
+                static const size_t MAX_STEPS = 8;
+
+                void set_prot(void* p, int prot);
+                void set_prot_prefix(void* p, size_t num_bytes, int prot);
+                void deallocate(void* p);
+
+            private:
+                friend class ParanoiaPool;
+
+                struct Step {
+                    void* p;
+                    size_t num_bytes; // SIZE_MAX means the whole allocation.
+                    int prot;
+                    bool deallocate;
+                };
+
+                Step steps_[MAX_STEPS];
+                size_t num_steps_ = 0;
+
+                void add_step(const Step & step);
+        };
+
+        void apply(const ProtPlan & plan);
+
+        // Bounds the address space held by live and quarantined allocations.
+        // Quarantined allocations have no physical memory behind them, so this is
+        // mostly a budget for quarantine depth, not for RSS.
         void set_preferred_max_bytes(size_t num_bytes);
 
+        // Allocations of at least 'num_bytes' are placed on huge-page boundaries,
+        // rounded up to whole huge pages, and madvise'd MADV_HUGEPAGE, so that
+        // the kernel can back them with transparent huge pages while they're
+        // live.  Quarantining a buffer remaps it PROT_NONE as usual, which
+        // drops its huge pages too.  SIZE_MAX (the default) disables this.
+        void set_huge_page_min_bytes(size_t num_bytes);
+
+        static const size_t DEFAULT_HUGE_PAGE_MIN_BYTES = SIZE_MAX;
+
+        // An accessible prefix that ends inside a huge page keeps that page
+        // split.  With this enabled, when the prefix grows to cover it, the pool
+        // asks the kernel to collapse it back (MADV_COLLAPSE, where supported).
+        // That's off by default: the collapse runs synchronously, under the
+        // shard's mutex, copying up to a huge page of memory.  Otherwise
+        // khugepaged collapses the page in the background, eventually.
+        void set_huge_page_collapse(bool enabled);
+
+        // paranoid_vectors using this pool split the construction, copying and
+        // relocation of at least 'num_bytes' of elements across a few threads
+        // (see paranoia_parallel.h).  The pieces are page-aligned, so the page
+        // faults are taken in parallel too.  Only element types whose
+        // constructors can't throw are split.  0 (the default) disables this.
+        void set_parallel_min_bytes(size_t num_bytes);
+        size_t get_parallel_min_bytes() const;
+
+        // Bytes in live allocations.  Only these can be backed by physical memory.
+        size_t get_resident_bytes() const;
+
+        // Bytes of address space held by live and quarantined allocations.
+        size_t get_reserved_bytes() const;
+
+        // True iff 'p' lies within the address space reserved by this pool,
+        // whether or not it currently belongs to a live allocation.
+        bool owns(const void* p) const;
+
+        // Starts a background thread that evicts quarantined allocations to keep
+        // the pool within its preferred budgets, so that allocate / deallocate
+        // don't have to.  Those still evict synchronously, but only once the pool
+        // is more than HARD_LIMIT_FACTOR times over a budget.
+        void start_background_drain();
+
+        // Also done by the destructor.
+        void stop_background_drain();
+
+        // How far the quarantine is over budget: the bytes / allocations that
+        // the drain thread (or the next synchronous GC) still has to evict.
+        size_t get_drain_backlog_bytes() const;
+        size_t get_drain_backlog_allocs() const;
+
+        static const size_t HARD_LIMIT_FACTOR = 2;
+
+        struct Stats {
+            size_t num_live_allocs;
+            size_t live_bytes;
+            size_t num_stale_allocs;
+            size_t stale_bytes;
+
+            // Syscalls issued by the pool, by type.
+            uint64_t num_mprotect_calls;
+            uint64_t num_mmap_calls;
+            uint64_t num_munmap_calls;
+            uint64_t num_mremap_calls;
+
+            // Quarantined allocations evicted by GC (synchronous or background).
+            uint64_t num_evictions;
+            uint64_t num_evicted_bytes;
+
+            // Calls to allocate(...) that threw.
+            uint64_t num_alloc_failures;
+
+            // Live allocations placed for huge pages (see set_huge_page_min_bytes),
+            // and how many of their bytes the kernel has actually backed with huge
+            // pages.  The latter comes from /proc/self/smaps, which is only read
+            // when there are any such allocations.
+            size_t num_huge_page_allocs;
+            size_t huge_page_alloc_bytes;
+            size_t huge_page_backed_bytes;
+
+            // Wall-clock time of each public call, including any wait for a
+            // shard's mutex.  'set_prot_latency' covers set_prot and
+            // set_prot_prefix.
+            ParanoiaLatencyHistogram allocate_latency;
+            ParanoiaLatencyHistogram deallocate_latency;
+            ParanoiaLatencyHistogram set_prot_latency;
+        };
+
+        // The counts and syscall / eviction totals are mutually consistent.  The
+        // latency histograms are recorded outside the shards' mutexes, so calls
+        // still in flight may or may not be included.
+        Stats get_stats() const;
+
+        // Installs a process-wide SIGSEGV handler.  When a fault lands in one of
+        // this pool's buffers, it reports which buffer it was, its size, and the
+        // call stacks that allocated and freed it, then lets the fault take its
+        // usual course.  Faults anywhere else are passed on to whatever handled
+        // SIGSEGV before.
+        //
+        // From then on, allocate and deallocate record their callers' stacks, by
+        // walking frame pointers, into a ring of 'num_stack_records' entries.
+        // The report is written from the signal handler, so it prints raw
+        // return addresses, followed by the process's executable mappings to
+        // symbolize them with offline (e.g. with addr2line).  Buffers whose
+        // stacks have been overwritten in the ring are still reported, just
+        // without the stacks.  Stacks stop at the first frame built without
+        // frame pointers, so build callers with -fno-omit-frame-pointer.
+        void enable_fault_reporting(size_t num_stack_records = DEFAULT_NUM_STACK_RECORDS);
+
+        static const size_t DEFAULT_NUM_STACK_RECORDS = 16 * 1024;
+
     private:
-        size_t preferred_max_bytes_;
-        size_t preferred_max_allocs_;
+        std::atomic<size_t> preferred_max_bytes_;
+        const size_t preferred_max_allocs_;
 
         struct AllocDetails {
             AllocDetails() = default;
@@ -32,16 +223,251 @@ class ParanoiaPool {
             void* addr;
             size_t num_bytes;
             int prot;
+
+            // Only the first 'num_prefix_bytes' have protection 'prot'.  Any
+            // pages after that are PROT_NONE.
+            size_t num_prefix_bytes;
+
+            // Sequence numbers of the allocating / freeing call stacks in the
+            // shard's 'stack_records', or 0 if none was recorded.
+            uint64_t alloc_stack_seq;
+            uint64_t free_stack_seq;
+
+            // Placed on huge-page boundaries, and madvise'd MADV_HUGEPAGE.
+            bool huge_pages;
         };
 
-        std::map<void*,AllocDetails> live_allocs_;
-        std::queue<AllocDetails> stale_allocs_;
-        size_t total_alloc_bytes_ = 0;
+        // Buffers are carved out of large PROT_NONE regions reserved with mmap,
+        // rather than coming from the C heap.  Neighbouring buffers with the
+        // same protection therefore merge into a single kernel VMA.
+        struct ArenaRegion {
+            char* base;
+            size_t num_bytes;
+            size_t num_bytes_used; // Everything past this has never been handed out.
+        };
+
+        static const size_t MAX_SIZE_CLASS_PAGES = 256;
+
+        // A call stack, as return addresses.  Captured before taking any shard's
+        // mutex, then copied into the shard's ring.
+        static const size_t MAX_STACK_FRAMES = 16;
+
+        struct CapturedStack {
+            size_t num_frames = 0;
+            void* frames[MAX_STACK_FRAMES];
+        };
+
+        struct StackRecord {
+            uint64_t seq; // Identifies which stack currently occupies this slot.
+            CapturedStack stack;
+        };
+
+        // The pool's state is split into shards, each with its own mutex and its
+        // own arena regions, so threads working in different shards never
+        // contend.  A thread allocates from its "home" shard; a buffer is
+        // deallocated (and quarantined) by the shard whose region holds it, no
+        // matter which thread frees it.
+        //
+        // Nothing holds more than one shard's mutex at a time, except
+        // get_stats(), which takes them all in index order.
+        static const size_t NUM_SHARDS = 16;
+
+        struct Shard {
+            Shard();
+
+            mutable std::mutex mutex;
+
+            // The thread holding 'mutex' through a ShardLock, or a
+            // value-initialized pthread_t.  Lets the fault handler see that the
+            // faulting thread was itself inside the pool.
+            std::atomic<pthread_t> owner{};
+
+            ParanoiaAllocTable<AllocDetails> live_allocs;
+            std::deque<AllocDetails> stale_allocs; // Oldest first.
+
+            std::vector<ArenaRegion> arena_regions;
+
+            // Ranges that were handed out and then evicted from quarantine.  They're
+            // already fresh PROT_NONE pages, so reusing one costs just the mprotect
+            // that gives it its initial protection.
+            //
+            // Ranges of up to MAX_SIZE_CLASS_PAGES pages are kept in exact
+            // per-page-count free lists, so steady-state workloads reuse them with no
+            // searching or splitting.  Larger ones are reused best-fit, and are
+            // merged with adjacent large free ranges (in the same region) as
+            // they're freed, so they don't fragment the arena.
+            std::vector<char*> size_class_free_ranges[MAX_SIZE_CLASS_PAGES + 1]; // Indexed by page count.
+            std::multimap<size_t,char*> large_free_ranges;
+            std::map<char*,size_t> large_free_ranges_by_addr; // The same ranges, by address.
+
+            // Sized on first use, once fault reporting is enabled.
+            std::vector<StackRecord> stack_records;
+            uint64_t next_stack_seq = 1;
+        };
+
+        // Holds 'shard.mutex', and records the holder in 'shard.owner'.
+        class ShardLock;
+
+        std::unique_ptr<Shard[]> shards_;
+
+        // Totals over all shards, for the budgets.  They only change under the
+        // mutex of the shard concerned, but are read without any lock.
+        std::atomic<size_t> num_live_allocs_{0};
+        std::atomic<size_t> num_stale_allocs_{0};
+        std::atomic<size_t> resident_bytes_{0};
+        std::atomic<size_t> reserved_bytes_{0};
+        std::atomic<size_t> num_huge_page_allocs_{0};
+        std::atomic<size_t> huge_page_alloc_bytes_{0};
+
+        std::atomic<size_t> huge_page_min_bytes_{DEFAULT_HUGE_PAGE_MIN_BYTES};
+        std::atomic<bool> huge_page_collapse_{false};
+        std::atomic<size_t> parallel_min_bytes_{0};
+
+        // The size of a buffer for 'num_bytes' (a whole number of pages), and
+        // whether it goes on huge pages.
+        size_t buffer_num_bytes(size_t num_bytes, bool & huge_pages) const;
+
+        // When a buffer's accessible prefix grows from 'old_open_bytes' to
+        // 'new_open_bytes', asks the kernel to collapse the huge page that the
+        // old prefix ended in, if the new one covers it and that's enabled.
+        void collapse_completed_huge_page(
+                const AllocDetails & details,
+                size_t old_open_bytes,
+                size_t new_open_bytes) const;
+
+        // AnonHugePages, summed over this pool's mappings in /proc/self/smaps.
+        size_t read_huge_page_backed_bytes() const;
+
+        // Every shard's arena regions, sorted by base address, so that the shard
+        // owning an address can be found by binary search without taking a
+        // lock.  Entries are only ever inserted, under 'region_dir_mutex_'.
+        // That makes 'region_dir_seq_' odd while entries are shifted to make
+        // room, and even again afterwards; a reader that sees it change retries.
+        static const size_t MAX_ARENA_REGIONS = 4096;
+
+        struct RegionDirEntry {
+            std::atomic<char*> base{nullptr};
+            std::atomic<size_t> num_bytes{0};
+            std::atomic<Shard*> shard{nullptr};
+        };
+
+        std::unique_ptr<RegionDirEntry[]> region_dir_;
+        std::atomic<size_t> num_region_dir_entries_{0};
+        std::atomic<uint64_t> region_dir_seq_{0};
+        std::mutex region_dir_mutex_;
+
+        static size_t home_shard_index();
+
+        // Returns nullptr if 'p' isn't in this pool's address space.
+        Shard* find_shard(const void* p) const;
+
+        // Aborts if 'p' isn't in this pool's address space.
+        Shard & owning_shard(const void* p) const;
+
+        // These expect the caller to hold 'shard.mutex'.
+        char* arena_take_range(Shard & shard, size_t num_bytes);
+        char* arena_take_huge_page_range(Shard & shard, size_t num_bytes);
+        void arena_store_free_range(Shard & shard, char* p, size_t num_bytes);
+        void arena_erase_large_free_range(Shard & shard, std::map<char*,size_t>::iterator by_addr_iter);
+        void arena_merge_large_neighbours(Shard & shard, char* & p, size_t & num_bytes);
+        static bool is_arena_region_base(const Shard & shard, const char* p);
+        void arena_return_range(Shard & shard, char* p, size_t num_bytes);
+        void arena_reserve_region(Shard & shard, size_t min_num_bytes);
+
+        void arena_release_pages(char* p, size_t num_bytes);
 
-        static size_t get_page_size();
         static size_t num_pages_needed(size_t num_bytes);
-        void gc_as_needed(size_t upcoming_alloc_bytes);
-        void gc_one_alloc();
+
+        std::atomic<bool> fault_reporting_enabled_{false};
+        std::atomic<size_t> num_stack_records_{0}; // Per shard.
+
+        static void capture_stack(CapturedStack & stack);
+
+        // These expect the caller to hold 'shard.mutex'.
+        uint64_t store_stack_locked(Shard & shard, const CapturedStack & stack);
+        const CapturedStack* find_stack_locked(const Shard & shard, uint64_t seq) const;
+
+        // Returns false if 'addr' isn't in this pool's address space.
+        bool report_fault(const char* addr);
+        static void fault_handler(int sig, siginfo_t* info, void* context);
+        static void register_fault_reporting_pool(ParanoiaPool* pool);
+        static void unregister_fault_reporting_pool(ParanoiaPool* pool);
+
+        // allocate(...), minus the latency and failure accounting.
+        void* do_allocate(size_t num_bytes, int initial_prot, size_t num_prefix_bytes, const CapturedStack* alloc_stack);
+
+        // A page range that needs an mprotect, or (if 'release') that needs to
+        // be released and poisoned.
+        struct PageOp {
+            char* addr;
+            size_t num_bytes;
+            int prot;
+            bool release;
+        };
+
+        static void add_prefix_change_ops(
+                const AllocDetails & details,
+                size_t new_prefix_bytes,
+                int prot,
+                PageOp* ops,
+                size_t & num_ops);
+
+        void issue_page_ops(PageOp* ops, size_t num_ops);
+
+        // Evicts the oldest quarantined allocations, starting with shard
+        // 'first_shard' and moving on to the others as each runs dry, until
+        // there's room for 'num_upcoming_allocs' (0 or 1) more allocations
+        // totalling 'upcoming_alloc_bytes'.  These must be called without
+        // holding any shard's mutex.
+        void gc_as_needed(size_t upcoming_alloc_bytes, size_t num_upcoming_allocs, size_t first_shard);
+        void gc_to_limits(
+                size_t upcoming_alloc_bytes,
+                size_t num_upcoming_allocs,
+                size_t max_bytes,
+                size_t max_allocs,
+                size_t first_shard);
+        bool over_limits(
+                size_t upcoming_alloc_bytes,
+                size_t num_upcoming_allocs,
+                size_t max_bytes,
+                size_t max_allocs) const;
+
+        // These expect the caller to hold 'shard.mutex'.  Every step of 'plan'
+        // must refer to a buffer in 'shard'.
+        void gc_one_alloc_locked(Shard & shard);
+        void apply_locked(Shard & shard, const ProtPlan & plan, const CapturedStack* free_stack = nullptr);
+
+        // Relaxed atomics, so that they're cheap to keep up to date and can be
+        // bumped outside any mutex.
+        struct StatCounters {
+            std::atomic<uint64_t> num_mprotect_calls{0};
+            std::atomic<uint64_t> num_mmap_calls{0};
+            std::atomic<uint64_t> num_munmap_calls{0};
+            std::atomic<uint64_t> num_mremap_calls{0};
+            std::atomic<uint64_t> num_evictions{0};
+            std::atomic<uint64_t> num_evicted_bytes{0};
+            std::atomic<uint64_t> num_alloc_failures{0};
+
+            ParanoiaAtomicLatencyHistogram allocate_latency;
+            ParanoiaAtomicLatencyHistogram deallocate_latency;
+            ParanoiaAtomicLatencyHistogram set_prot_latency;
+        };
+
+        StatCounters stats_;
+
+        static void bump(std::atomic<uint64_t> & counter, uint64_t n = 1);
+
+        // The drain thread's own state, guarded by 'drain_mutex_'.  Request threads
+        // only take that mutex to wake the drain thread when it's idle.
+        std::mutex drain_mutex_;
+        std::thread drain_thread_;
+        std::condition_variable drain_cv_;
+        bool drain_stop_ = false;
+        std::atomic<bool> drain_running_{false};
+        std::atomic<bool> drain_idle_{false};
+
+        void drain_loop();
+        void wake_drain_thread();
 };
 
 extern const std::shared_ptr<ParanoiaPool> g_paranoia_default_pool;
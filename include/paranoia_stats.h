@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Latencies counted in log2 buckets: bucket i holds latencies in
+// [2^i, 2^(i+1)) nanoseconds.  Bucket 0 also holds 0 ns, and the last bucket
+// holds everything from 2^(NUM_BUCKETS-1) ns (about nine minutes) up.
+struct ParanoiaLatencyHistogram {
+    static const size_t NUM_BUCKETS = 40;
+
+    uint64_t counts[NUM_BUCKETS] = {};
+
+    uint64_t total_count() const;
+
+    // An upper bound for quantile 'q' (0 <= q <= 1): the top of the bucket
+    // that holds it, in nanoseconds.  Returns 0 for an empty histogram.
+    uint64_t quantile_upper_bound_ns(double q) const;
+
+    static size_t bucket_of(uint64_t ns);
+};
+
+// The recording side of ParanoiaLatencyHistogram.  Each bucket is a relaxed
+// atomic, so recording is cheap enough to leave on permanently; a snapshot
+// taken while others are recording is only approximately consistent.
+class ParanoiaAtomicLatencyHistogram {
+    public:
+        void record_ns(uint64_t ns);
+        ParanoiaLatencyHistogram snapshot() const;
+
+    private:
+        std::atomic<uint64_t> counts_[ParanoiaLatencyHistogram::NUM_BUCKETS] = {};
+};
+
+inline size_t ParanoiaLatencyHistogram::bucket_of(uint64_t ns)
+{
+    const size_t bucket = (ns == 0) ? 0 : size_t(63 - __builtin_clzll(ns));
+    return (bucket < NUM_BUCKETS) ? bucket : (NUM_BUCKETS - 1);
+}
+
+inline void ParanoiaAtomicLatencyHistogram::record_ns(uint64_t ns)
+{
+    counts_[ParanoiaLatencyHistogram::bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+}
@@ -3,26 +3,41 @@
 #include "util.h"
 #include "paranoia_pool.h"
 #include "paranoia_allocator.h"
+#include "paranoia_check_policy.h"
+#include "paranoia_checked_iterator.h"
+#include "paranoia_parallel.h"
 
 #include <algorithm>
+#include <atomic>
 #include <sstream>
 #include <stdexcept>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <initializer_list>
 #include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 // LIMITATIONS:
 // - Not all vector methods / members are provided.
+// - Spare capacity is only protected at page granularity: elements past size()
+//   that share a page with the last element are still accessible.
 // - Does not guarantee alignment requirements of stored elements.
 // - Does not leverage std::allocator_traits as much as it probably should.
+// - Illegal concurrent use is only detected with paranoia_concurrency_checks,
+//   and then only between mutating calls.
 
-// WISHLIST:
-// - Make this thead-aware.to look for illegal concurrent use.
-
-// TODO: Make this class thread-aware, by using a test-and-set bit to look for illegal concurrency.
-
-template <typename T>
+// 'Policy' is one of the policies in paranoia_check_policy.h.  To let the
+// build (or the element type) choose, use paranoid_vector_t instead.
+template <typename T, typename Policy = paranoia_full_checks>
 class paranoid_vector {
+    static_assert(! std::is_same<Policy, paranoia_passthrough>::value,
+            "paranoia_passthrough means plain std::vector; use paranoid_vector_t to select it.");
+
     public:
         using value_type             = T;
         using allocator_type         = paranoia_allocator<T>;
@@ -32,14 +47,17 @@ class paranoid_vector {
         using const_reference        = const T&;
         using pointer                = typename std::allocator_traits<allocator_type>::pointer;
         using const_pointer          = typename std::allocator_traits<allocator_type>::const_pointer;
-        using iterator               = pointer;
-        using const_iterator         = const_pointer;
+        using iterator               = typename std::conditional<Policy::check_iterators,
+                                                    paranoia_checked_iterator<T>, pointer>::type;
+        using const_iterator         = typename std::conditional<Policy::check_iterators,
+                                                    paranoia_checked_iterator<const T>, const_pointer>::type;
         using reverse_iterator       = typename std::reverse_iterator<iterator>;
         using const_reverse_iterator = typename std::reverse_iterator<const_iterator>;
 
         explicit paranoid_vector(size_t count);
         paranoid_vector(std::shared_ptr<allocator_type> allocator = std::make_shared<allocator_type>());
-        paranoid_vector(const paranoid_vector<T>& other);
+        paranoid_vector(const paranoid_vector<T, Policy>& other);
+        paranoid_vector(paranoid_vector<T, Policy>&& other) noexcept;
         paranoid_vector(std::initializer_list<value_type> l);
         template <class InputIt> paranoid_vector(InputIt first, InputIt last);
         paranoid_vector( size_type count, const T& value );
@@ -48,19 +66,19 @@ class paranoid_vector {
 
         ~paranoid_vector();
 
-        iterator begin() noexcept;
+        iterator begin();
         const_iterator begin() const noexcept;
         const_iterator cbegin() const noexcept;
 
-        iterator end() noexcept;
+        iterator end();
         const_iterator end() const noexcept;
         const_iterator cend() const noexcept;
 
-        reverse_iterator rbegin() noexcept;
+        reverse_iterator rbegin();
         const_reverse_iterator rbegin() const noexcept;
         const_reverse_iterator crbegin() const noexcept;
 
-        reverse_iterator rend() noexcept;
+        reverse_iterator rend();
         const_reverse_iterator rend() const noexcept;
         const_reverse_iterator crend() const noexcept;
 
@@ -70,7 +88,12 @@ class paranoid_vector {
         template< class... Args >
             void emplace_back( Args&&... args );
 
+        template< class... Args >
+            iterator emplace( const_iterator pos, Args&&... args );
+
         void reserve (size_type n);
+        size_type capacity() const;
+        void shrink_to_fit();
         size_type size() const;
         bool empty() const;
 
@@ -81,11 +104,13 @@ class paranoid_vector {
         void push_back(value_type&& x);
 
         paranoid_vector& operator=( const paranoid_vector& other );
+        paranoid_vector& operator=( paranoid_vector&& other ) noexcept;
+        void swap( paranoid_vector& other ) noexcept;
         reference at( size_type pos );
         const_reference at( size_type pos ) const;
         reference operator[]( size_type pos );
         const_reference operator[]( size_type pos ) const;
-        T* data() noexcept;
+        T* data();
         const T* data() const noexcept;
         void clear() noexcept;
 
@@ -94,27 +119,145 @@ class paranoid_vector {
         void pop_back();
 
         iterator insert( const_iterator pos, const_reference value );
-
-        template< class InputIt >
+        iterator insert( const_iterator pos, value_type&& value );
+        iterator insert( const_iterator pos, size_type count, const_reference value );
+        iterator insert( const_iterator pos, std::initializer_list<value_type> l );
+
+        // Only takes part in overload resolution for iterator types, so that
+        // insert(pos, count, value) isn't mistaken for a range.
+        template< class InputIt,
+                  typename = typename std::iterator_traits<InputIt>::iterator_category >
             iterator insert( const_iterator pos, InputIt first, InputIt last );
 
+        // Each of these relocates the buffer at most once, however long the
+        // range is.
+        template< class Range >
+            iterator insert_range( const_iterator pos, Range&& range );
+
+        template< class Range >
+            void append_range( Range&& range );
+
         reference front();
         const_reference front() const;
 
         reference back();
         const_reference back() const;
 
+        // Returns a copy that shares this vector's buffer, without copying any
+        // elements.  The shared buffer is made PROT_READ, so a write to it
+        // through a raw pointer or iterator faults.  The first mutating call on
+        // any of the sharing vectors (including non-const element access)
+        // gives that vector a private copy of the buffer, or simply takes it
+        // back once no other vector shares it.  Copying a sharing vector also
+        // just shares the buffer.
+        //
+        // So unlike std::vector's, the non-const accessors (begin(), data(),
+        // operator[] etc.) aren't noexcept: on a sharing vector, the first one
+        // called copies the elements, and throws if it can't.  Call a const
+        // accessor (or cbegin()) to read without unsharing.  Non-const element
+        // access on a sharing vector is a mutation, so it mustn't race with
+        // other calls on that vector.
+        paranoid_vector snapshot();
+
     private:
         std::shared_ptr<paranoia_allocator<T>> allocator_;
         std::shared_ptr<ParanoiaPool> ppool_; // assumed to point at allocator_->ppool_ for lifespan of this vector.
 
         size_type num_elem_actual_ = 0;
+        size_type num_elem_capacity_ = 0;
 
         size_t buffer_size_bytes_ = 0; // Total buffer allocation size, in bytes.
         T* buffer_ = nullptr; // nullptr indicates we have no current allocation.
 
-        void set_attached_buffer(T* new_buffer, size_type new_num_elem_capacity);
-
+        // Size of the leading part of buffer_ that is PROT_READ|PROT_WRITE
+        // (or just PROT_READ, while the buffer is shared).  The remaining
+        // (spare capacity) pages are kept PROT_NONE.
+        size_t num_bytes_accessible_ = 0;
+
+        // A buffer shared by snapshot().  Whichever vector lets go of it last
+        // destroys the elements and deallocates it.
+        struct SharedBuffer {
+            SharedBuffer(std::shared_ptr<ParanoiaPool> ppool, T* buffer, size_type num_elem);
+            ~SharedBuffer();
+
+            const std::shared_ptr<ParanoiaPool> ppool;
+            T* buffer; // nullptr once a vector has taken the buffer back for itself.
+            const size_type num_elem;
+        };
+
+        // Non-null iff buffer_ is shared.
+        std::shared_ptr<SharedBuffer> shared_;
+
+        // With Policy::check_concurrency, every mutating method holds one of
+        // these while it runs.  Aborts if another thread is mutating the same
+        // vector; nested calls on one thread are fine.
+        class MutationGuard {
+            public:
+                explicit MutationGuard(paranoid_vector & v);
+                ~MutationGuard();
+
+                MutationGuard(const MutationGuard &) = delete;
+                MutationGuard & operator=(const MutationGuard &) = delete;
+
+            private:
+                // nullptr unless this guard claimed the vector, i.e. it isn't nested.
+                paranoid_vector* v_ = nullptr;
+        };
+
+        // Identifies the thread that's part-way through a mutating call, or 0
+        // if none is.  Only used with Policy::check_concurrency.
+        std::atomic<uintptr_t> mutating_thread_{0};
+
+        static uintptr_t current_thread_token();
+
+        // Only used with Policy::check_iterators.  Follows the elements: it's
+        // swapped along with the buffer, and only released when the vector is
+        // destroyed.
+        ParanoiaIteratorControl* iter_control_ =
+            Policy::check_iterators ? paranoia_acquire_iterator_control() : nullptr;
+
+        // Called whenever the elements move to another buffer (or go away).
+        void invalidate_iterators() noexcept;
+
+        // Conversions between iterators and addresses in buffer_.  Unwrapping
+        // a checked iterator checks that it's still valid.
+        iterator make_iterator(T* p) const noexcept;
+        const_iterator make_const_iterator(const T* p) const noexcept;
+        T* unwrap_iterator(const_iterator i) const;
+
+        // Every mutating method calls this first, so that it has a private,
+        // writable buffer to work on.
+        void unshare();
+        void unshare_slow();
+
+        // Detaches from a shared buffer, leaving this vector empty.
+        void drop_shared_buffer() noexcept;
+
+        void set_attached_buffer(
+                T* new_buffer,
+                size_type new_num_elem,
+                size_type new_num_elem_capacity);
+
+        // Quarantines 'old_buffer' (if non-null) and attaches 'new_buffer'.
+        // The protection changes for both buffers go to the pool as a single
+        // ParanoiaPool::ProtPlan.
+        void replace_attached_buffer(
+                T* old_buffer,
+                T* new_buffer,
+                size_type new_num_elem,
+                size_type new_num_elem_capacity);
+
+        // Opens / closes pages of the attached buffer so that exactly the pages
+        // holding the first 'num_elem' elements are accessible.
+        void set_accessible_elems(size_type num_elem);
+
+        size_type grown_capacity(size_type min_elem_capacity) const;
+
+        // If 'prot' is PROT_NONE, the caller must pass 'old_buffer' on to
+        // deallocate_unattached_buffer or replace_attached_buffer, which
+        // poison it anyway.  So in that case we skip the mprotect.
+        // The used pages are already PROT_READ|PROT_WRITE, so asking for that
+        // is free too; relocation needs it, to move elements out.
         void detach_current_buffer(
                 int prot,
                 T* & old_buffer,
@@ -122,72 +265,367 @@ class paranoid_vector {
                 );
 
         void deallocate_unattached_buffer(
-                T* buffer,
-                int prot);
-
-        void create_replacement_buffer(
-                const size_type new_buffer_elem_capacity,
-                const T* old_buffer,
-                const size_type old_buffer_num_elem,
-                T* & new_buffer,
-                T* & new_content_begin);
-
-        T* create_uninit_buffer(const size_type num_elem_capacity);
+                T* buffer);
+
+        // Move-constructs 'num_elem' elements from 'src' into the raw memory
+        // at 'dst' (copying instead if T's move constructor might throw), then
+        // destroys the originals.
+        void relocate_elems(
+                T* src,
+                size_type num_elem,
+                T* dst);
+
+        // Copy-constructs 'num_elem' elements from 'src' into the raw memory
+        // at 'dst'.
+        void copy_elems(
+                const T* src,
+                size_type num_elem,
+                T* dst);
+
+        // Constructs 'num_elem' copies of 'val' / value-initialized elements
+        // in the raw memory at 'dst'.
+        void fill_elems(
+                T* dst,
+                size_type num_elem,
+                const T& val);
+
+        void value_init_elems(
+                T* dst,
+                size_type num_elem);
+
+        // Calls f(first, last) on consecutive index ranges that together cover
+        // [0, num_elem).  When the pool's parallel_min_bytes allows it, the
+        // ranges run concurrently, and each starts on a page boundary of
+        // 'dst'; otherwise there's just one.  'f' must not throw.
+        template <typename F>
+            void for_each_chunk(
+                    const T* dst,
+                    size_type num_elem,
+                    const F & f);
+
+        // Leaves 'other' empty, but still attached to its allocator.
+        void steal_buffer(paranoid_vector& other) noexcept;
+
+        // The actual capacity may exceed 'num_elem_capacity', because the
+        // buffer is rounded up to a whole number of pages.
+        // Only the pages that will hold the first 'num_elem_accessible'
+        // elements are made accessible.
+        T* create_uninit_buffer(
+                const size_type num_elem_capacity,
+                const size_type num_elem_accessible,
+                size_type & actual_elem_capacity);
+
+        // For trivially copyable T, growing a large buffer by moving its pages
+        // (see ParanoiaPool::grow_by_remap) beats copying the elements.
+        bool worth_growing_by_remap() const;
+
+        // Grows the attached buffer in place, as far as its contents go: the
+        // elements keep their indices, and only the buffer's address changes.
+        // Only valid when worth_growing_by_remap() is true.
+        void grow_by_remap(
+                const size_type num_elem_capacity,
+                const size_type num_elem_accessible);
 
         size_type remaining_elem_capacity() const;
+
+        // Moves the elements to a new buffer with room for at least
+        // 'new_capacity_wanted', leaving a gap of 'gap_num_elem' elements at
+        // index 'gap_index'.  construct_gap(gap) fills the gap before any old
+        // element is moved from, so its arguments may refer to elements of
+        // this vector.  The old buffer stays attached until nothing else can
+        // throw, so if anything does, the vector is left as it was.
+        // Returns the start of the gap.
+        template <typename F>
+            T* relocate_with_gap(
+                    size_type new_capacity_wanted,
+                    size_type gap_index,
+                    size_type gap_num_elem,
+                    const F & construct_gap);
+
+        // Inserts 'num_new_elem' elements at 'pos', which construct_new_elems
+        // builds in place, as for relocate_with_gap.  Returns where they went.
+        template <typename F>
+            T* relocating_insert(
+                    T* pos,
+                    size_type num_new_elem,
+                    const F & construct_new_elems);
 };
 
-template <typename T>
-void paranoid_vector<T>::pop_back()
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::MutationGuard::MutationGuard(paranoid_vector & v)
 {
-    assert(! empty());
-    erase(end()-1);
+    if constexpr (Policy::check_concurrency) {
+        const uintptr_t me = current_thread_token();
+        uintptr_t holder = 0;
+
+        if (v.mutating_thread_.compare_exchange_strong(holder, me, std::memory_order_acquire)) {
+            v_ = &v;
+        }
+        else if (holder != me) {
+            std::fprintf(stderr, "paranoid_vector %p: mutated by two threads at once.\n", static_cast<void*>(&v));
+            std::abort();
+        }
+    }
+    else {
+        (void)v;
+    }
 }
 
-template <typename T>
-typename paranoid_vector<T>::iterator paranoid_vector<T>::erase( const_iterator first, const_iterator last )
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::MutationGuard::~MutationGuard()
 {
-    assert(!"TODO");
+    if constexpr (Policy::check_concurrency) {
+        if (v_) {
+            v_->mutating_thread_.store(0, std::memory_order_release);
+        }
+    }
 }
 
-template <typename T>
-typename paranoid_vector<T>::iterator paranoid_vector<T>::erase( const_iterator pos )
+template <typename T, typename Policy>
+uintptr_t paranoid_vector<T, Policy>::current_thread_token()
 {
-    assert(pos >= buffer_);
-    assert(pos < buffer_ + num_elem_actual_);
+    // Unique among live threads.
+    thread_local const char token = 0;
+    return reinterpret_cast<uintptr_t>(&token);
+}
 
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::invalidate_iterators() noexcept
+{
+    if constexpr (Policy::check_iterators) {
+        iter_control_->invalidate_iterators();
+    }
+}
+
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::make_iterator(T* p) const noexcept
+{
+    if constexpr (Policy::check_iterators) {
+        return iterator(iter_control_, p);
+    }
+    else {
+        return p;
+    }
+}
+
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_iterator paranoid_vector<T, Policy>::make_const_iterator(const T* p) const noexcept
+{
+    if constexpr (Policy::check_iterators) {
+        return const_iterator(iter_control_, p);
+    }
+    else {
+        return p;
+    }
+}
+
+template <typename T, typename Policy>
+T* paranoid_vector<T, Policy>::unwrap_iterator(const_iterator i) const
+{
+    if constexpr (Policy::check_iterators) {
+        return const_cast<T*>(i.get());
+    }
+    else {
+        return const_cast<T*>(i);
+    }
+}
+
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::SharedBuffer::SharedBuffer(
+        std::shared_ptr<ParanoiaPool> ppool,
+        T* buffer,
+        size_type num_elem)
+    : ppool(ppool), buffer(buffer), num_elem(num_elem)
+{
+}
+
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::SharedBuffer::~SharedBuffer()
+{
+    if (! buffer) {
+        return;
+    }
+
+    if constexpr (! std::is_trivially_destructible<T>::value) {
+        // Destructors may write to the elements.
+        ppool->set_prot_prefix(buffer, sizeof(T) * num_elem, PROT_READ | PROT_WRITE);
+        std::destroy_n(buffer, num_elem);
+    }
 
-    const size_type new_num_elem = old_num_elem - 1;
-    T* const new_buffer = create_uninit_buffer(new_num_elem);
+    ppool->deallocate(buffer);
+}
 
-    const size_type range1_num_elems = pos - old_buffer;
-    const size_type range2_num_elems = old_num_elem - range1_num_elems - 1;
+template <typename T, typename Policy>
+paranoid_vector<T, Policy> paranoid_vector<T, Policy>::snapshot()
+{
+    static_assert(std::is_copy_constructible<T>::value,
+            "snapshot() requires copy-constructible elements");
 
-    T* dst = new_buffer;
+    MutationGuard guard(*this);
 
-    if (range1_num_elems > 0) {
-        std::uninitialized_copy_n(old_buffer, range1_num_elems, dst);
-        dst += range1_num_elems;
+    if (buffer_ && (! shared_)) {
+        ParanoiaPool & ppool = *(allocator_->ppool_);
+        num_bytes_accessible_ = ppool.set_prot_prefix(buffer_, sizeof(T) * num_elem_actual_, PROT_READ);
+        shared_ = std::make_shared<SharedBuffer>(allocator_->ppool_, buffer_, num_elem_actual_);
     }
 
-    if (range2_num_elems > 0) {
-        std::uninitialized_copy_n(old_buffer + range1_num_elems + 1, range2_num_elems, dst);
+    paranoid_vector s(allocator_);
+    s.shared_ = shared_;
+    s.buffer_ = buffer_;
+    s.num_elem_actual_ = num_elem_actual_;
+    s.num_elem_capacity_ = num_elem_capacity_;
+    s.buffer_size_bytes_ = buffer_size_bytes_;
+    s.num_bytes_accessible_ = num_bytes_accessible_;
+    return s;
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::unshare()
+{
+    // snapshot() requires copyable elements, so otherwise there's nothing to do.
+    if constexpr (std::is_copy_constructible<T>::value) {
+        if (shared_) {
+            unshare_slow();
+        }
     }
+}
 
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::unshare_slow()
+{
+    MutationGuard guard(*this);
+
+    assert(shared_);
+    assert(shared_->buffer == buffer_);
+
+    if (shared_.use_count() == 1) {
+        // Nobody else can see the buffer any more, so it's ours again.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        shared_->buffer = nullptr;
+        shared_.reset();
+
+        ParanoiaPool & ppool = *(allocator_->ppool_);
+        num_bytes_accessible_ = ppool.set_prot_prefix(
+                buffer_, sizeof(T) * num_elem_actual_, PROT_READ | PROT_WRITE);
+        return;
+    }
+
+    size_type new_capacity;
+    T* const new_buffer = create_uninit_buffer(num_elem_capacity_, num_elem_actual_, new_capacity);
+
+    try {
+        copy_elems(buffer_, num_elem_actual_, new_buffer);
+    }
+    catch (...) {
+        deallocate_unattached_buffer(new_buffer);
+        throw;
+    }
+
+    // The other vectors still hold the old buffer.
+    shared_.reset();
+    set_attached_buffer(new_buffer, num_elem_actual_, new_capacity);
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::drop_shared_buffer() noexcept
+{
+    assert(shared_);
+
+    shared_.reset();
+    invalidate_iterators();
+
+    buffer_ = nullptr;
+    num_elem_actual_ = 0;
+    num_elem_capacity_ = 0;
+    buffer_size_bytes_ = 0;
+    num_bytes_accessible_ = 0;
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::pop_back()
+{
+    MutationGuard guard(*this);
+    unshare();
+    assert(! empty());
+
+    // No reallocation needed: the popped element is destroyed in place, and
+    // its page is closed if no other element still lives on it.
+    --num_elem_actual_;
+    (buffer_ + num_elem_actual_)->~T();
+    set_accessible_elems(num_elem_actual_);
+}
+
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::erase( const_iterator first_iter, const_iterator last_iter )
+{
+    MutationGuard guard(*this);
+
+    T* first = unwrap_iterator(first_iter);
+    T* last = unwrap_iterator(last_iter);
+
+    if (shared_) {
+        const size_type first_index = first - buffer_;
+        const size_type last_index = last - buffer_;
+        unshare();
+        first = buffer_ + first_index;
+        last = buffer_ + last_index;
+    }
+
+    assert(first >= buffer_);
+    assert(first <= last);
+    assert(last <= buffer_ + num_elem_actual_);
+
+    if (first == last) {
+        return make_iterator(first);
     }
 
-    set_attached_buffer(new_buffer, new_num_elem);
+    // We still move the remaining elements to a fresh buffer, so that any
+    // iterators invalidated by the erase fault when used.
+    const size_type old_capacity = num_elem_capacity_;
+
+    T* old_buffer;
+    size_type old_num_elem;
+    detach_current_buffer(PROT_READ | PROT_WRITE, old_buffer, old_num_elem);
+
+    const size_type num_erased_elem = last - first;
+    const size_type new_num_elem = old_num_elem - num_erased_elem;
+    size_type new_capacity;
+    T* const new_buffer = create_uninit_buffer(old_capacity, new_num_elem, new_capacity);
 
-    return iterator(pos);
+    const size_type range1_num_elems = first - old_buffer;
+    const size_type range2_num_elems = old_num_elem - range1_num_elems - num_erased_elem;
+
+    relocate_elems(old_buffer, range1_num_elems, new_buffer);
+    std::destroy_n(old_buffer + range1_num_elems, num_erased_elem);
+    relocate_elems(old_buffer + range1_num_elems + num_erased_elem, range2_num_elems, new_buffer + range1_num_elems);
+
+    replace_attached_buffer(old_buffer, new_buffer, new_num_elem, new_capacity);
+
+    return make_iterator(new_buffer + range1_num_elems);
+}
+
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::erase( const_iterator pos )
+{
+    assert(unwrap_iterator(pos) < buffer_ + num_elem_actual_);
+    return erase(pos, pos + 1);
 }
 
-template <typename T>
-void paranoid_vector<T>::set_attached_buffer(T* new_buffer, size_type new_num_elem_capacity)
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::set_attached_buffer(
+        T* new_buffer,
+        size_type new_num_elem,
+        size_type new_num_elem_capacity)
+{
+    replace_attached_buffer(nullptr, new_buffer, new_num_elem, new_num_elem_capacity);
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::replace_attached_buffer(
+        T* old_buffer,
+        T* new_buffer,
+        size_type new_num_elem,
+        size_type new_num_elem_capacity)
 {
     if (new_buffer) {
         assert(new_num_elem_capacity > 0);
@@ -196,57 +634,288 @@ void paranoid_vector<T>::set_attached_buffer(T* new_buffer, size_type new_num_el
         assert(new_num_elem_capacity == 0);
     }
 
+    assert(new_num_elem <= new_num_elem_capacity);
+
+    invalidate_iterators();
+
     buffer_ = new_buffer;
-    num_elem_actual_ = new_num_elem_capacity;
+    num_elem_actual_ = new_num_elem;
+    num_elem_capacity_ = new_num_elem_capacity;
     buffer_size_bytes_ = sizeof(T) * new_num_elem_capacity;
+
+    ParanoiaPool::ProtPlan plan;
+
+    if (old_buffer) {
+        plan.deallocate(old_buffer);
+    }
+
+    if (new_buffer) {
+        // The new buffer may have more or fewer pages open than its content
+        // needs, so let the pool work out which ones need to change.
+        const size_t page_size = ParanoiaPool::get_page_size();
+        const size_t num_bytes_used = sizeof(T) * new_num_elem;
+        plan.set_prot_prefix(new_buffer, num_bytes_used, PROT_READ | PROT_WRITE);
+        num_bytes_accessible_ = ((num_bytes_used + page_size - 1) / page_size) * page_size;
+    }
+    else {
+        num_bytes_accessible_ = 0;
+    }
+
+    if (old_buffer || new_buffer) {
+        ParanoiaPool & ppool = *(allocator_->ppool_);
+        ppool.apply(plan);
+    }
 }
 
-template <typename T>
-T* paranoid_vector<T>::create_uninit_buffer(const size_type num_elem_capacity)
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::set_accessible_elems(size_type num_elem)
+{
+    assert(num_elem <= num_elem_capacity_);
+
+    if (! buffer_) {
+        return;
+    }
+
+    const size_t num_bytes_needed = sizeof(T) * num_elem;
+    const size_t page_size = ParanoiaPool::get_page_size();
+
+    if ((num_bytes_needed > num_bytes_accessible_) ||
+            (num_bytes_accessible_ - num_bytes_needed >= page_size))
+    {
+        ParanoiaPool & ppool = *(allocator_->ppool_);
+        num_bytes_accessible_ = ppool.set_prot_prefix(
+                buffer_, num_bytes_needed, PROT_READ | PROT_WRITE);
+    }
+}
+
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::size_type paranoid_vector<T, Policy>::grown_capacity(size_type min_elem_capacity) const
+{
+    // Geometric growth keeps appends amortized O(1).
+    return std::max(min_elem_capacity, 2 * num_elem_capacity_);
+}
+
+template <typename T, typename Policy>
+T* paranoid_vector<T, Policy>::create_uninit_buffer(
+        const size_type num_elem_capacity,
+        const size_type num_elem_accessible,
+        size_type & actual_elem_capacity)
 {
     if (num_elem_capacity == 0) {
+        actual_elem_capacity = 0;
         return nullptr;
     }
     else {
         ParanoiaPool & ppool = *(allocator_->ppool_);
-        const size_t new_size_bytes = num_elem_capacity * sizeof(T);
-        return reinterpret_cast<T*>(ppool.allocate(new_size_bytes));
+        const size_t page_size = ParanoiaPool::get_page_size();
+        const size_t min_size_bytes = num_elem_capacity * sizeof(T);
+        const size_t new_size_bytes = ((min_size_bytes + page_size - 1) / page_size) * page_size;
+
+        actual_elem_capacity = new_size_bytes / sizeof(T);
+        return reinterpret_cast<T*>(ppool.allocate(
+                    new_size_bytes, PROT_READ | PROT_WRITE, num_elem_accessible * sizeof(T)));
     }
 }
 
-template <typename T>
-void paranoid_vector<T>::deallocate_unattached_buffer(
-        T* buffer,
-        int prot)
+template <typename T, typename Policy>
+bool paranoid_vector<T, Policy>::worth_growing_by_remap() const
 {
-    assert(buffer);
+    return std::is_trivially_copyable<T>::value &&
+        buffer_ &&
+        (sizeof(T) * num_elem_actual_ >= ParanoiaPool::REMAP_MIN_BYTES);
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::grow_by_remap(
+        const size_type num_elem_capacity,
+        const size_type num_elem_accessible)
+{
+    assert(worth_growing_by_remap());
+    assert(num_elem_capacity > num_elem_capacity_);
 
     ParanoiaPool & ppool = *(allocator_->ppool_);
+    const size_t page_size = ParanoiaPool::get_page_size();
+    const size_t min_size_bytes = num_elem_capacity * sizeof(T);
+    const size_t new_size_bytes = ((min_size_bytes + page_size - 1) / page_size) * page_size;
+    const size_t num_bytes_needed = sizeof(T) * num_elem_accessible;
+
+    invalidate_iterators();
+
+    buffer_ = reinterpret_cast<T*>(ppool.grow_by_remap(buffer_, new_size_bytes, num_bytes_needed));
+    num_elem_capacity_ = new_size_bytes / sizeof(T);
+    buffer_size_bytes_ = sizeof(T) * num_elem_capacity_;
+    num_bytes_accessible_ = std::max(
+            num_bytes_accessible_,
+            ((num_bytes_needed + page_size - 1) / page_size) * page_size);
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::deallocate_unattached_buffer(
+        T* buffer)
+{
+    assert(buffer);
 
-    ppool.set_prot(buffer, prot);
+    // No need to make it PROT_NONE first; the pool does that as part of
+    // deallocating it.
+    ParanoiaPool & ppool = *(allocator_->ppool_);
     ppool.deallocate(buffer);
 }
 
-template <typename T>
-void paranoid_vector<T>::create_replacement_buffer(
-        const size_type new_elem_capacity,
-        const T* old_buffer,
-        const size_type old_buffer_num_elem,
-        T* & new_buffer,
-        T* & new_content_begin)
+template <typename T, typename Policy>
+template <typename F>
+void paranoid_vector<T, Policy>::for_each_chunk(
+        const T* dst,
+        size_type num_elem,
+        const F & f)
+{
+    const size_t num_bytes = sizeof(T) * num_elem;
+    const size_t min_bytes = allocator_->ppool_->get_parallel_min_bytes();
+
+    if ((min_bytes == 0) || (num_bytes < min_bytes)) {
+        f(size_type(0), num_elem);
+        return;
+    }
+
+    // A few chunks per thread, to even out the load.
+    const size_t num_chunks = std::max(size_t(1), std::min(
+                4 * paranoia_parallel_num_threads(),
+                num_bytes / PARANOIA_PARALLEL_MIN_CHUNK_BYTES));
+
+    const uintptr_t page_size = ParanoiaPool::get_page_size();
+    const uintptr_t base = reinterpret_cast<uintptr_t>(dst);
+
+    // The first element starting at or after the k'th chunk's page boundary.
+    const auto chunk_start = [&](size_t k) -> size_type {
+        if (k == 0) {
+            return 0;
+        }
+        if (k == num_chunks) {
+            return num_elem;
+        }
+
+        const uintptr_t addr = (base + k * (num_bytes / num_chunks) + page_size - 1) & ~(page_size - 1);
+        return std::min(num_elem, size_type((addr - base + sizeof(T) - 1) / sizeof(T)));
+    };
+
+    paranoia_parallel_for(num_chunks, [&](size_t k) {
+        const size_type first = chunk_start(k);
+        const size_type last = chunk_start(k + 1);
+        if (first < last) {
+            f(first, last);
+        }
+    });
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::relocate_elems(
+        T* src,
+        size_type num_elem,
+        T* dst)
+{
+    if constexpr (std::is_trivially_copyable<T>::value) {
+        // Nothing to construct or destroy, just bytes to move.
+        for_each_chunk(dst, num_elem, [&](size_type first, size_type last) {
+            paranoia_bulk_copy(dst + first, src + first, sizeof(T) * (last - first));
+        });
+        return;
+    }
+    else if constexpr (std::is_nothrow_move_constructible<T>::value) {
+        for_each_chunk(dst, num_elem, [&](size_type first, size_type last) {
+            std::uninitialized_move(src + first, src + last, dst + first);
+            std::destroy(src + first, src + last);
+        });
+        return;
+    }
+
+    size_type i = 0;
+    try {
+        for (; i < num_elem; ++i) {
+            new (dst + i) T(std::move_if_noexcept(src[i]));
+        }
+    }
+    catch (...) {
+        // Only reachable when copying, so 'src' is still intact.
+        std::destroy_n(dst, i);
+        throw;
+    }
+
+    std::destroy_n(src, num_elem);
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::copy_elems(
+        const T* src,
+        size_type num_elem,
+        T* dst)
 {
-    new_buffer = create_uninit_buffer(new_elem_capacity);
+    if constexpr (std::is_trivially_copyable<T>::value) {
+        for_each_chunk(dst, num_elem, [&](size_type first, size_type last) {
+            paranoia_bulk_copy(dst + first, src + first, sizeof(T) * (last - first));
+        });
+    }
+    else if constexpr (std::is_nothrow_copy_constructible<T>::value) {
+        for_each_chunk(dst, num_elem, [&](size_type first, size_type last) {
+            std::uninitialized_copy(src + first, src + last, dst + first);
+        });
+    }
+    else {
+        std::uninitialized_copy_n(src, num_elem, dst);
+    }
+}
 
-    const size_t num_elem_to_copy = std::min(old_buffer_num_elem, new_elem_capacity);
-    if (num_elem_to_copy > 0) {
-        std::uninitialized_copy_n(old_buffer, num_elem_to_copy, new_buffer);
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::fill_elems(
+        T* dst,
+        size_type num_elem,
+        const T& val)
+{
+    if constexpr (std::is_nothrow_copy_constructible<T>::value) {
+        for_each_chunk(dst, num_elem, [&](size_type first, size_type last) {
+            std::uninitialized_fill(dst + first, dst + last, val);
+        });
+    }
+    else {
+        std::uninitialized_fill_n(dst, num_elem, val);
     }
+}
 
-    new_content_begin = new_buffer + num_elem_to_copy;
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::value_init_elems(
+        T* dst,
+        size_type num_elem)
+{
+    if constexpr (std::is_nothrow_default_constructible<T>::value) {
+        for_each_chunk(dst, num_elem, [&](size_type first, size_type last) {
+            std::uninitialized_value_construct(dst + first, dst + last);
+        });
+    }
+    else {
+        std::uninitialized_value_construct_n(dst, num_elem);
+    }
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::steal_buffer(paranoid_vector& other) noexcept
+{
+    buffer_ = other.buffer_;
+    num_elem_actual_ = other.num_elem_actual_;
+    num_elem_capacity_ = other.num_elem_capacity_;
+    buffer_size_bytes_ = other.buffer_size_bytes_;
+    num_bytes_accessible_ = other.num_bytes_accessible_;
+    shared_ = std::move(other.shared_);
+
+    // Iterators into 'other' now refer to our elements.
+    std::swap(iter_control_, other.iter_control_);
+
+    other.buffer_ = nullptr;
+    other.num_elem_actual_ = 0;
+    other.num_elem_capacity_ = 0;
+    other.buffer_size_bytes_ = 0;
+    other.num_bytes_accessible_ = 0;
 }
 
-template <typename T>
-void paranoid_vector<T>::detach_current_buffer(
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::detach_current_buffer(
         int prot,
         T* & old_buffer,
         size_type & old_num_elem_actual)
@@ -254,413 +923,582 @@ void paranoid_vector<T>::detach_current_buffer(
     old_buffer = buffer_;
     old_num_elem_actual = num_elem_actual_;
 
-    set_attached_buffer(nullptr, 0);
+    set_attached_buffer(nullptr, 0, 0);
 
-    if (old_buffer) {
+    if (old_buffer && (prot != PROT_NONE) && (prot != (PROT_READ | PROT_WRITE))) {
+        // Spare capacity pages are already PROT_NONE; leave them that way.
         ParanoiaPool & ppool = *(allocator_->ppool_);
-        ppool.set_prot(old_buffer, prot);
+        ppool.set_prot_prefix(old_buffer, sizeof(T) * old_num_elem_actual, prot);
     }
 }
 
-template <typename T>
-void paranoid_vector<T>::resize (size_type count, const value_type& val)
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::resize (size_type count, const value_type& val)
 {
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
+    MutationGuard guard(*this);
+    unshare();
 
-    T* new_buffer;
-    T* new_content_begin;
-    create_replacement_buffer(
-            count,
-            old_buffer, old_num_elem,
-            new_buffer, new_content_begin);
+    if (count <= num_elem_capacity_) {
+        if (count > num_elem_actual_) {
+            set_accessible_elems(count);
+            fill_elems(buffer_ + num_elem_actual_, count - num_elem_actual_, val);
+        }
+        else {
+            for (size_type i = count; i < num_elem_actual_; ++i) {
+                (buffer_ + i)->~T();
+            }
+        }
 
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
+        num_elem_actual_ = count;
+        set_accessible_elems(count);
+        return;
     }
 
-    const size_type num_additional_elem = std::min<size_type>(0, count - old_num_elem);
-    for (size_type i = 0; i < num_additional_elem; ++i) {
-        new (new_content_begin + i) T(val);
+    const size_type new_capacity_wanted = grown_capacity(count);
+
+    if constexpr (std::is_trivially_copyable<T>::value) {
+        if (worth_growing_by_remap()) {
+            // 'val' may refer to an element of the old buffer, which is about
+            // to become inaccessible.
+            const T val_copy = val;
+
+            grow_by_remap(new_capacity_wanted, count);
+            fill_elems(buffer_ + num_elem_actual_, count - num_elem_actual_, val_copy);
+
+            num_elem_actual_ = count;
+            return;
+        }
     }
 
-    set_attached_buffer(new_buffer, count);
+    // 'val' may refer to an element of the old buffer; relocate_with_gap
+    // copies it before the old elements are moved from.
+    const size_type num_new_elem = count - num_elem_actual_;
+    relocate_with_gap(new_capacity_wanted, num_elem_actual_, num_new_elem, [&](T* gap) {
+        fill_elems(gap, num_new_elem, val);
+    });
 }
 
-template <typename T>
-void paranoid_vector<T>::resize( size_type count )
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::resize( size_type count )
 {
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
+    MutationGuard guard(*this);
+    unshare();
 
-    T* new_buffer;
-    T* new_content_begin;
-    create_replacement_buffer(
-            count,
-            old_buffer, old_num_elem,
-            new_buffer, new_content_begin);
+    if (count <= num_elem_capacity_) {
+        if (count > num_elem_actual_) {
+            set_accessible_elems(count);
+            value_init_elems(buffer_ + num_elem_actual_, count - num_elem_actual_);
+        }
+        else {
+            for (size_type i = count; i < num_elem_actual_; ++i) {
+                (buffer_ + i)->~T();
+            }
+        }
 
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
+        num_elem_actual_ = count;
+        set_accessible_elems(count);
+        return;
     }
 
-    const size_type num_additional_elem = std::min<size_type>(0, count - old_num_elem);
-    for (size_type i = 0; i < num_additional_elem; ++i) {
-        new (new_content_begin + i) T();
+    const size_type new_capacity_wanted = grown_capacity(count);
+
+    if (worth_growing_by_remap()) {
+        grow_by_remap(new_capacity_wanted, count);
+        value_init_elems(buffer_ + num_elem_actual_, count - num_elem_actual_);
+
+        num_elem_actual_ = count;
+        return;
     }
 
-    set_attached_buffer(new_buffer, count);
+    const size_type num_new_elem = count - num_elem_actual_;
+    relocate_with_gap(new_capacity_wanted, num_elem_actual_, num_new_elem, [&](T* gap) {
+        value_init_elems(gap, num_new_elem);
+    });
 }
 
-template <typename T>
-bool paranoid_vector<T>::empty() const
+template <typename T, typename Policy>
+bool paranoid_vector<T, Policy>::empty() const
 {
     return num_elem_actual_ == 0;
 }
 
-template <typename T>
-template< class InputIt >
-typename paranoid_vector<T>::iterator
-    paranoid_vector<T>::insert(
-        paranoid_vector<T>::const_iterator pos,
+template <typename T, typename Policy>
+template< class InputIt, typename >
+typename paranoid_vector<T, Policy>::iterator
+    paranoid_vector<T, Policy>::insert(
+        paranoid_vector<T, Policy>::const_iterator pos,
         InputIt first,
         InputIt last )
 {
-    const auto num_input_elem = std::distance(first, last);
-    assert(num_input_elem >= 0);
+    MutationGuard guard(*this);
+
+    using category = typename std::iterator_traits<InputIt>::iterator_category;
 
-    if (num_input_elem == 0) {
-        return iterator(pos);
+    if constexpr (! std::is_base_of<std::forward_iterator_tag, category>::value) {
+        // A single-pass range can't be measured without consuming it, so
+        // stage it first; that keeps us to one relocation.
+        std::vector<T> staged(first, last);
+        return insert(pos, std::make_move_iterator(staged.begin()), std::make_move_iterator(staged.end()));
     }
+    else {
+        const auto num_input_elem = std::distance(first, last);
+        assert(num_input_elem >= 0);
 
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
+        if (num_input_elem == 0) {
+            return make_iterator(unwrap_iterator(pos));
+        }
+
+        T* const insertion_point = relocating_insert(unwrap_iterator(pos), num_input_elem, [&](T* gap) {
+            std::uninitialized_copy_n(first, num_input_elem, gap);
+        });
+
+        return make_iterator(insertion_point);
+    }
+}
 
-    assert(pos >= old_buffer);
-    assert(pos < old_buffer + old_num_elem);
+template <typename T, typename Policy>
+template< class Range >
+typename paranoid_vector<T, Policy>::iterator
+    paranoid_vector<T, Policy>::insert_range(
+        paranoid_vector<T, Policy>::const_iterator pos,
+        Range&& range )
+{
+    return insert(pos, std::begin(range), std::end(range));
+}
 
-    const size_type new_num_elem = old_num_elem + num_input_elem;
-    T* const new_buffer = create_uninit_buffer(new_num_elem);
+template <typename T, typename Policy>
+template< class Range >
+void paranoid_vector<T, Policy>::append_range( Range&& range )
+{
+    MutationGuard guard(*this);
+    unshare();
+
+    auto first = std::begin(range);
+    auto last = std::end(range);
+
+    using category = typename std::iterator_traits<decltype(first)>::iterator_category;
+
+    if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+        // Like emplace_back, fill spare capacity in place when it's enough.
+        const size_type num_input_elem = std::distance(first, last);
+        if (num_input_elem <= remaining_elem_capacity()) {
+            set_accessible_elems(num_elem_actual_ + num_input_elem);
+            std::uninitialized_copy_n(first, num_input_elem, buffer_ + num_elem_actual_);
+            num_elem_actual_ += num_input_elem;
+            return;
+        }
+    }
 
-    const size_type range1_num_elems = pos - old_buffer;
-    const size_type range2_num_elems = old_num_elem - range1_num_elems;
+    insert(cend(), first, last);
+}
 
-    T* dst = new_buffer;
+template <typename T, typename Policy>
+template <typename F>
+T* paranoid_vector<T, Policy>::relocate_with_gap(
+        size_type new_capacity_wanted,
+        size_type gap_index,
+        size_type gap_num_elem,
+        const F & construct_gap)
+{
+    T* const old_buffer = buffer_;
+    const size_type old_num_elem = num_elem_actual_;
+    assert(gap_index <= old_num_elem);
 
-    if (range1_num_elems > 0) {
-        std::uninitialized_copy_n(old_buffer, range1_num_elems, dst);
-        dst += range1_num_elems;
+    const size_type new_num_elem = old_num_elem + gap_num_elem;
+    size_type new_capacity;
+    T* const new_buffer = create_uninit_buffer(new_capacity_wanted, new_num_elem, new_capacity);
+    T* const gap = new_buffer + gap_index;
+
+    try {
+        construct_gap(gap);
+    }
+    catch (...) {
+        if (new_buffer) {
+            deallocate_unattached_buffer(new_buffer);
+        }
+        throw;
     }
 
-    const iterator insertion_point = dst;
-    std::uninitialized_copy_n(first, num_input_elem, dst);
-    dst += num_input_elem;
+    T* const after_gap = gap + gap_num_elem;
+    const size_type num_after_gap = old_num_elem - gap_index;
 
-    if (range2_num_elems > 0) {
-        std::uninitialized_copy_n(old_buffer + range1_num_elems, range2_num_elems, dst);
+    if constexpr (std::is_trivially_copyable<T>::value || std::is_nothrow_move_constructible<T>::value) {
+        relocate_elems(old_buffer, gap_index, new_buffer);
+        relocate_elems(old_buffer + gap_index, num_after_gap, after_gap);
     }
+    else {
+        // We're copying, so don't destroy any originals until every copy
+        // has succeeded.
+        size_type num_before_done = 0;
+        size_type num_after_done = 0;
+        try {
+            for (; num_before_done < gap_index; ++num_before_done) {
+                new (new_buffer + num_before_done) T(std::move_if_noexcept(old_buffer[num_before_done]));
+            }
+            for (; num_after_done < num_after_gap; ++num_after_done) {
+                new (after_gap + num_after_done) T(std::move_if_noexcept(old_buffer[gap_index + num_after_done]));
+            }
+        }
+        catch (...) {
+            std::destroy_n(new_buffer, num_before_done);
+            std::destroy_n(gap, gap_num_elem);
+            std::destroy_n(after_gap, num_after_done);
+            deallocate_unattached_buffer(new_buffer);
+            throw;
+        }
 
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
+        std::destroy_n(old_buffer, old_num_elem);
+    }
+
+    replace_attached_buffer(old_buffer, new_buffer, new_num_elem, new_capacity);
+    return gap;
+}
+
+template <typename T, typename Policy>
+template <typename F>
+T* paranoid_vector<T, Policy>::relocating_insert(
+        T* pos,
+        size_type num_new_elem,
+        const F & construct_new_elems)
+{
+    if (shared_) {
+        const size_type pos_index = pos - buffer_;
+        unshare();
+        pos = buffer_ + pos_index;
     }
 
-    set_attached_buffer(new_buffer, new_num_elem);
+    assert(pos >= buffer_);
+    assert(pos <= buffer_ + num_elem_actual_);
+
+    // Only grow if we must; otherwise every insert would double the capacity.
+    const size_type min_capacity = num_elem_actual_ + num_new_elem;
+    const size_type new_capacity_wanted =
+        (min_capacity <= num_elem_capacity_) ? num_elem_capacity_ : grown_capacity(min_capacity);
 
-    return insertion_point;
+    return relocate_with_gap(new_capacity_wanted, pos - buffer_, num_new_elem, construct_new_elems);
 }
 
-template <typename T>
-bool operator!=(const paranoid_vector<T> & lhs, const paranoid_vector<T> & rhs) {
+template <typename T, typename Policy>
+bool operator==(const paranoid_vector<T, Policy> & lhs, const paranoid_vector<T, Policy> & rhs) {
     if (lhs.size() != rhs.size()) {
-        return true;
+        return false;
     }
 
     const size_t num_elem = lhs.size();
-    for (size_t i = 0; i < num_elem; ++i) {
-        if (lhs[i] != rhs[i]) {
-            return true;
-        }
+    if (num_elem == 0) {
+        return true;
     }
 
-    return false;
+    // Go straight to the buffers rather than through operator[], which may
+    // bounds-check every element.
+    const T* const l = lhs.data();
+    const T* const r = rhs.data();
+
+    if constexpr (std::is_integral<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value) {
+        // For these, equal values means equal bytes, and memcmp is vectorized.
+        return std::memcmp(l, r, sizeof(T) * num_elem) == 0;
+    }
+    else {
+        return std::equal(l, l + num_elem, r);
+    }
 }
 
-template <typename T>
-bool operator==(const paranoid_vector<T> & lhs, const paranoid_vector<T> & rhs) {
-    return ! (lhs != rhs);
+template <typename T, typename Policy>
+bool operator!=(const paranoid_vector<T, Policy> & lhs, const paranoid_vector<T, Policy> & rhs) {
+    return ! (lhs == rhs);
 }
 
-template <typename T>
-void paranoid_vector<T>::set_pool_preferred_max_size_bytes(size_t num_bytes)
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::set_pool_preferred_max_size_bytes(size_t num_bytes)
 {
     assert(allocator_);
     assert(allocator_->ppool_);
     allocator_->ppool_->set_preferred_max_bytes(num_bytes);
 }
 
-template <typename T>
-paranoid_vector<T>::paranoid_vector(size_type count)
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::paranoid_vector(size_type count)
     : paranoid_vector(count, T())
 {
 }
 
-template <typename T>
-paranoid_vector<T>::paranoid_vector(size_type count, const T& value)
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::paranoid_vector(size_type count, const T& value)
     : paranoid_vector()
 {
-    T* const new_buffer = create_uninit_buffer(count);
+    size_type new_capacity;
+    T* const new_buffer = create_uninit_buffer(count, count, new_capacity);
 
-    for (size_type i = 0; i < count; ++i) {
-        new (new_buffer + i) T(value);
+    try {
+        fill_elems(new_buffer, count, value);
+    }
+    catch (...) {
+        deallocate_unattached_buffer(new_buffer);
+        throw;
     }
 
-    set_attached_buffer(new_buffer, count);
+    set_attached_buffer(new_buffer, count, new_capacity);
 }
 
-template <typename T>
-typename paranoid_vector<T>::reverse_iterator paranoid_vector<T>::rbegin() noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::reverse_iterator paranoid_vector<T, Policy>::rbegin()
 {
     return reverse_iterator(end());
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reverse_iterator paranoid_vector<T>::rbegin() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reverse_iterator paranoid_vector<T, Policy>::rbegin() const noexcept
 {
     return const_reverse_iterator(end());
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reverse_iterator paranoid_vector<T>::crbegin() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reverse_iterator paranoid_vector<T, Policy>::crbegin() const noexcept
 {
     return const_reverse_iterator(end());
 }
 
-template <typename T>
-typename paranoid_vector<T>::reverse_iterator paranoid_vector<T>::rend() noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::reverse_iterator paranoid_vector<T, Policy>::rend()
 {
     return reverse_iterator(begin());
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reverse_iterator paranoid_vector<T>::rend() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reverse_iterator paranoid_vector<T, Policy>::rend() const noexcept
 {
     return  const_reverse_iterator(begin());
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reverse_iterator paranoid_vector<T>::crend() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reverse_iterator paranoid_vector<T, Policy>::crend() const noexcept
 {
     return const_reverse_iterator(begin());
 }
 
-template <typename T>
+template <typename T, typename Policy>
 template <class InputIt>
-paranoid_vector<T>::paranoid_vector(InputIt first, InputIt last)
+paranoid_vector<T, Policy>::paranoid_vector(InputIt first, InputIt last)
     : paranoid_vector()
 {
     assign(first, last);
 }
 
-template <typename T>
-void paranoid_vector<T>::push_back(value_type&& x)
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::push_back(value_type&& x)
 {
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
-
-    const size_type new_num_elem = old_num_elem + 1;
-
-    T* new_buffer;
-    T* new_content_begin;
-    create_replacement_buffer(
-            new_num_elem,
-            old_buffer, old_num_elem,
-            new_buffer, new_content_begin);
-
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
-    }
-
-    new (new_content_begin) T(x);
-
-    set_attached_buffer(new_buffer, new_num_elem);
+    emplace_back(std::move(x));
 }
 
-template <typename T>
+template <typename T, typename Policy>
 template< class... Args >
-void paranoid_vector<T>::emplace_back( Args&&... args )
+void paranoid_vector<T, Policy>::emplace_back( Args&&... args )
 {
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
+    MutationGuard guard(*this);
+    unshare();
+
+    if (num_elem_actual_ < num_elem_capacity_) {
+        set_accessible_elems(num_elem_actual_ + 1);
+        new (buffer_ + num_elem_actual_) T(std::forward<Args>(args)...);
+        ++num_elem_actual_;
+        return;
+    }
 
-    const size_type new_num_elem = old_num_elem + 1;
+    const size_type new_capacity_wanted = grown_capacity(num_elem_actual_ + 1);
 
-    T* new_buffer;
-    T* new_content_begin;
-    create_replacement_buffer(
-            new_num_elem,
-            old_buffer, old_num_elem,
-            new_buffer, new_content_begin);
+    if constexpr (std::is_trivially_copyable<T>::value) {
+        if (worth_growing_by_remap()) {
+            // 'args' may refer to elements of the old buffer, which is about
+            // to become inaccessible.
+            const T new_elem(std::forward<Args>(args)...);
 
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
+            grow_by_remap(new_capacity_wanted, num_elem_actual_ + 1);
+            new (buffer_ + num_elem_actual_) T(new_elem);
+            ++num_elem_actual_;
+            return;
+        }
     }
 
-    new (new_content_begin) T(args...);
-
-    set_attached_buffer(new_buffer, new_num_elem);
+    // 'args' may refer to elements of the old buffer; relocate_with_gap
+    // constructs the new element before the old elements are moved from.
+    relocate_with_gap(new_capacity_wanted, num_elem_actual_, 1, [&](T* gap) {
+        new (gap) T(std::forward<Args>(args)...);
+    });
 }
 
-template <typename T>
-typename paranoid_vector<T>::reference paranoid_vector<T>::front()
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::reference paranoid_vector<T, Policy>::front()
 {
+    unshare();
     assert(buffer_);
     return buffer_[0];
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reference paranoid_vector<T>::front() const
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reference paranoid_vector<T, Policy>::front() const
 {
     assert(buffer_);
     return buffer_[0];
 }
 
-template <typename T>
-typename paranoid_vector<T>::reference paranoid_vector<T>::back()
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::reference paranoid_vector<T, Policy>::back()
 {
+    unshare();
     assert(buffer_);
     T* p_back = buffer_ + num_elem_actual_ - 1;
     return *p_back;
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reference paranoid_vector<T>::back() const
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reference paranoid_vector<T, Policy>::back() const
 {
     assert(buffer_);
     T* p_back = buffer_ + num_elem_actual_ - 1;
     return *p_back;
 }
 
-template <typename T>
-void paranoid_vector<T>::reserve (paranoid_vector<T>::size_type n)
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::reserve (paranoid_vector<T, Policy>::size_type n)
 {
-    // TODO:
-    // Right now we're not catering to this usage profile, and we
-    // have too much code written that assumes capacity() == size()
-    // for it to be a really quick feature to add.
+    MutationGuard guard(*this);
+
+    if (n <= num_elem_capacity_) {
+        return;
+    }
+
+    unshare();
+
+    if (worth_growing_by_remap()) {
+        grow_by_remap(n, num_elem_actual_);
+        return;
+    }
+
+    relocate_with_gap(n, num_elem_actual_, 0, [](T*) {});
+}
+
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::size_type paranoid_vector<T, Policy>::capacity() const
+{
+    return num_elem_capacity_;
+}
+
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::shrink_to_fit()
+{
+    MutationGuard guard(*this);
+    unshare();
+
+    size_type fitted_capacity;
+    {
+        const size_t page_size = ParanoiaPool::get_page_size();
+        const size_t num_pages = (num_elem_actual_ * sizeof(T) + page_size - 1) / page_size;
+        fitted_capacity = (num_pages * page_size) / sizeof(T);
+    }
+
+    if (fitted_capacity >= num_elem_capacity_) {
+        return;
+    }
+
+    relocate_with_gap(num_elem_actual_, num_elem_actual_, 0, [](T*) {});
 }
 
-template <typename T>
-paranoid_vector<T>::paranoid_vector(std::initializer_list<value_type> l)
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::paranoid_vector(std::initializer_list<value_type> l)
     : paranoid_vector()
 {
     this->assign(l.begin(), l.end());
 }
 
-template <typename T>
-typename paranoid_vector<T>::iterator paranoid_vector<T>::begin() noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::begin()
 {
-    return buffer_;
+    unshare();
+    return make_iterator(buffer_);
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_iterator paranoid_vector<T>::begin() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_iterator paranoid_vector<T, Policy>::begin() const noexcept
 {
-    return buffer_;
+    return make_const_iterator(buffer_);
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_iterator paranoid_vector<T>::cbegin() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_iterator paranoid_vector<T, Policy>::cbegin() const noexcept
 {
-    return buffer_;
+    return make_const_iterator(buffer_);
 }
 
-template <typename T>
-typename paranoid_vector<T>::iterator paranoid_vector<T>::end() noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::end()
 {
+    unshare();
+
     // Technically this could cause pointer overflow (i.e., wraparound), but
     // in practice that won't happen.
-    return buffer_ + num_elem_actual_;
+    return make_iterator(buffer_ + num_elem_actual_);
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_iterator paranoid_vector<T>::end() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_iterator paranoid_vector<T, Policy>::end() const noexcept
 {
     // Technically this could cause pointer overflow (i.e., wraparound), but
     // in practice that won't happen.
-    return buffer_ + num_elem_actual_;
+    return make_const_iterator(buffer_ + num_elem_actual_);
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_iterator paranoid_vector<T>::cend() const noexcept
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_iterator paranoid_vector<T, Policy>::cend() const noexcept
 {
     // Technically this could cause pointer overflow (i.e., wraparound), but
     // in practice that won't happen.
-    return buffer_ + num_elem_actual_;
+    return make_const_iterator(buffer_ + num_elem_actual_);
 }
 
-template <typename T>
-paranoid_vector<T>::paranoid_vector(const paranoid_vector<T>& other)
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::paranoid_vector(const paranoid_vector<T, Policy>& other)
     : paranoid_vector(other.allocator_)
 {
     (*this) = other;
 }
 
-template <typename T>
-typename paranoid_vector<T>::size_type paranoid_vector<T>::size() const {
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::paranoid_vector(paranoid_vector<T, Policy>&& other) noexcept
+    : allocator_(other.allocator_),
+      ppool_(other.ppool_)
+{
+    // The buffer belongs to other's pool, so we share other's allocator.
+    MutationGuard other_guard(other);
+    steal_buffer(other);
+}
+
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::size_type paranoid_vector<T, Policy>::size() const {
     return num_elem_actual_;
 }
 
-template <typename T>
-paranoid_vector<T>::~paranoid_vector()
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::~paranoid_vector()
 {
     clear();
+    paranoia_release_iterator_control(iter_control_);
 }
 
-template <typename T>
-typename paranoid_vector<T>::size_type  paranoid_vector<T>::remaining_elem_capacity() const {
-    const size_t bytes_used = num_elem_actual_ * sizeof(T);
-    const size_t bytes_remaining = buffer_size_bytes_ - bytes_used;
-
-    if (bytes_remaining == 0) {
-        return 0;
-    }
-    else {
-        return sizeof(T) / bytes_remaining;
-    }
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::size_type  paranoid_vector<T, Policy>::remaining_elem_capacity() const {
+    return num_elem_capacity_ - num_elem_actual_;
 }
 
-template <typename T>
-void paranoid_vector<T>::push_back(const paranoid_vector<T>::value_type& x) {
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
-
-    const size_type new_num_elem = old_num_elem + 1;
-
-    T* new_buffer;
-    T* new_content_begin;
-    create_replacement_buffer(
-            new_num_elem,
-            old_buffer, old_num_elem,
-            new_buffer, new_content_begin);
-
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
-    }
-
-    new (new_content_begin) T(x);
-
-    set_attached_buffer(new_buffer, new_num_elem);
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::push_back(const paranoid_vector<T, Policy>::value_type& x) {
+    emplace_back(x);
 }
 
-template <typename T>
-typename paranoid_vector<T>::reference paranoid_vector<T>::at( paranoid_vector<T>::size_type pos ) {
-    if (pos > num_elem_actual_)
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::reference paranoid_vector<T, Policy>::at( paranoid_vector<T, Policy>::size_type pos ) {
+    unshare();
+
+    if (pos >= num_elem_actual_)
     {
         std::ostringstream os;
         os << "size()=" << size() << " but pos=" << pos;
@@ -670,9 +1508,9 @@ typename paranoid_vector<T>::reference paranoid_vector<T>::at( paranoid_vector<T
     return *(buffer_ + pos);
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reference paranoid_vector<T>::at( paranoid_vector<T>::size_type pos ) const {
-    if (pos > num_elem_actual_)
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reference paranoid_vector<T, Policy>::at( paranoid_vector<T, Policy>::size_type pos ) const {
+    if (pos >= num_elem_actual_)
     {
         std::ostringstream os;
         os << "size()=" << size() << " but pos=" << pos;
@@ -682,39 +1520,63 @@ typename paranoid_vector<T>::const_reference paranoid_vector<T>::at( paranoid_ve
     return *(buffer_ + pos);
 }
 
-template <typename T>
-typename paranoid_vector<T>::reference paranoid_vector<T>::operator[]( paranoid_vector<T>::size_type pos ) {
-    return at(pos);
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::reference paranoid_vector<T, Policy>::operator[]( paranoid_vector<T, Policy>::size_type pos ) {
+    if constexpr (Policy::check_index) {
+        return at(pos);
+    }
+    else {
+        unshare();
+        return buffer_[pos];
+    }
 }
 
-template <typename T>
-typename paranoid_vector<T>::const_reference paranoid_vector<T>::operator[]( paranoid_vector<T>::size_type pos ) const {
-    return at(pos);
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::const_reference paranoid_vector<T, Policy>::operator[]( paranoid_vector<T, Policy>::size_type pos ) const {
+    if constexpr (Policy::check_index) {
+        return at(pos);
+    }
+    else {
+        return buffer_[pos];
+    }
 }
 
-template <typename T>
-T* paranoid_vector<T>::data() noexcept {
+template <typename T, typename Policy>
+T* paranoid_vector<T, Policy>::data() {
+    unshare();
     return buffer_;
 }
 
-template <typename T>
-const T* paranoid_vector<T>::data() const noexcept {
+template <typename T, typename Policy>
+const T* paranoid_vector<T, Policy>::data() const noexcept {
     return buffer_;
 }
 
-template <typename T>
-void paranoid_vector<T>::clear() noexcept {
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::clear() noexcept {
+    MutationGuard guard(*this);
+
+    if (shared_) {
+        // The elements live on in the other vectors.
+        drop_shared_buffer();
+        return;
+    }
+
+    for (size_type i = 0; i < num_elem_actual_; ++i) {
+        (buffer_ + i)->~T();
+    }
+
     T* old_buffer;
     size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
+    detach_current_buffer(PROT_NONE, old_buffer, old_num_elem);
 
     if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
+        deallocate_unattached_buffer(old_buffer);
     }
 }
 
-template <typename T>
-paranoid_vector<T>::paranoid_vector(std::shared_ptr<allocator_type> allocator)
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>::paranoid_vector(std::shared_ptr<allocator_type> allocator)
 {
     assert(allocator);
     assert(allocator->ppool_);
@@ -723,101 +1585,210 @@ paranoid_vector<T>::paranoid_vector(std::shared_ptr<allocator_type> allocator)
     ppool_ = allocator_->ppool_;
 }
 
-template <typename T>
-paranoid_vector<T>& paranoid_vector<T>::operator=( const paranoid_vector& other ) {
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_NONE, old_buffer, old_num_elem);
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>& paranoid_vector<T, Policy>::operator=( const paranoid_vector& other ) {
+    if (this == &other) {
+        return *this;
+    }
 
+    MutationGuard guard(*this);
+
+    if (other.shared_) {
+        // Just share it too.  The buffer belongs to other's pool, so we switch
+        // to other's allocator.
+        clear();
+
+        allocator_ = other.allocator_;
+        ppool_ = other.ppool_;
+        shared_ = other.shared_;
+        buffer_ = other.buffer_;
+        num_elem_actual_ = other.num_elem_actual_;
+        num_elem_capacity_ = other.num_elem_capacity_;
+        buffer_size_bytes_ = other.buffer_size_bytes_;
+        num_bytes_accessible_ = other.num_bytes_accessible_;
+        return *this;
+    }
+
+    // Keep our own elements until the copy has succeeded.
     const size_type new_num_elem = other.size();
-    T* new_buffer = create_uninit_buffer(new_num_elem);
+    size_type new_capacity;
+    T* new_buffer = create_uninit_buffer(new_num_elem, new_num_elem, new_capacity);
 
     if (new_num_elem > 0) {
         assert(other.buffer_);
         assert(new_buffer);
-        std::uninitialized_copy_n(other.buffer_, new_num_elem, new_buffer);
+
+        try {
+            copy_elems(other.buffer_, new_num_elem, new_buffer);
+        }
+        catch (...) {
+            deallocate_unattached_buffer(new_buffer);
+            throw;
+        }
     }
 
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
+    if (shared_) {
+        drop_shared_buffer();
+    }
+
+    T* old_buffer;
+    size_type old_num_elem;
+    detach_current_buffer(PROT_NONE, old_buffer, old_num_elem);
+
+    std::destroy_n(old_buffer, old_num_elem);
+    replace_attached_buffer(old_buffer, new_buffer, new_num_elem, new_capacity);
+
+    return *this;
+}
+
+template <typename T, typename Policy>
+paranoid_vector<T, Policy>& paranoid_vector<T, Policy>::operator=( paranoid_vector&& other ) noexcept {
+    if (this == &other) {
+        return *this;
     }
 
-    set_attached_buffer(new_buffer, new_num_elem);
+    MutationGuard guard(*this);
+    MutationGuard other_guard(other);
+
+    clear();
+
+    // The buffer belongs to other's pool, so we switch to other's allocator.
+    allocator_ = other.allocator_;
+    ppool_ = other.ppool_;
+    steal_buffer(other);
 
     return *this;
 }
 
-template <typename T>
+template <typename T, typename Policy>
+void paranoid_vector<T, Policy>::swap( paranoid_vector& other ) noexcept {
+    using std::swap;
+
+    MutationGuard guard(*this);
+    MutationGuard other_guard(other);
+
+    swap(allocator_, other.allocator_);
+    swap(ppool_, other.ppool_);
+    swap(num_elem_actual_, other.num_elem_actual_);
+    swap(num_elem_capacity_, other.num_elem_capacity_);
+    swap(buffer_size_bytes_, other.buffer_size_bytes_);
+    swap(buffer_, other.buffer_);
+    swap(num_bytes_accessible_, other.num_bytes_accessible_);
+    swap(shared_, other.shared_);
+    swap(iter_control_, other.iter_control_);
+}
+
+template <typename T, typename Policy>
+void swap(paranoid_vector<T, Policy> & lhs, paranoid_vector<T, Policy> & rhs) noexcept {
+    lhs.swap(rhs);
+}
+
+template <typename T, typename Policy>
 template <typename InputIt>
-void paranoid_vector<T>::assign(InputIt first, InputIt last)
+void paranoid_vector<T, Policy>::assign(InputIt first, InputIt last)
 {
     // FIXME: This should do a SFINAE check to confirm that InputIt is truly an input iterator
 
-    const auto new_num_elem = std::distance(first, last);
+    MutationGuard guard(*this);
+    unshare();
 
-    T* old_buffer;
-    size_type old_num_elem;
-    detach_current_buffer(PROT_NONE, old_buffer, old_num_elem);
-
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
-    }
+    const auto new_num_elem = std::distance(first, last);
 
+    // The input range may lie within our current buffer, and a copy may
+    // throw, so don't give that up until we're done copying.
     T* new_buffer;
+    size_type new_capacity;
 
     if (new_num_elem > 0) {
-        new_buffer = create_uninit_buffer(new_num_elem);
-        std::uninitialized_copy_n(first, new_num_elem, new_buffer);
+        new_buffer = create_uninit_buffer(new_num_elem, new_num_elem, new_capacity);
+
+        try {
+            std::uninitialized_copy_n(first, new_num_elem, new_buffer);
+        }
+        catch (...) {
+            deallocate_unattached_buffer(new_buffer);
+            throw;
+        }
     }
     else {
         new_buffer = nullptr;
+        new_capacity = 0;
     }
 
-    set_attached_buffer(new_buffer, new_num_elem);
-}
-
-template <typename T>
-typename paranoid_vector<T>::iterator paranoid_vector<T>::insert(
-        paranoid_vector<T>::const_iterator pos,
-        paranoid_vector<T>::const_reference val)
-{
     T* old_buffer;
     size_type old_num_elem;
-    detach_current_buffer(PROT_READ, old_buffer, old_num_elem);
+    detach_current_buffer(PROT_NONE, old_buffer, old_num_elem);
 
-    assert(pos >= old_buffer);
-    assert(pos < old_buffer + old_num_elem);
+    std::destroy_n(old_buffer, old_num_elem);
+    replace_attached_buffer(old_buffer, new_buffer, new_num_elem, new_capacity);
+}
 
-    const size_type new_num_elem = old_num_elem + 1;
-    T* const new_buffer = create_uninit_buffer(new_num_elem);
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::insert(
+        paranoid_vector<T, Policy>::const_iterator pos,
+        paranoid_vector<T, Policy>::const_reference val)
+{
+    return emplace(pos, val);
+}
 
-    const size_type range1_num_elems = pos - old_buffer;
-    const size_type range2_num_elems = old_num_elem - range1_num_elems;
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::insert(
+        paranoid_vector<T, Policy>::const_iterator pos,
+        paranoid_vector<T, Policy>::value_type&& val)
+{
+    return emplace(pos, std::move(val));
+}
 
-    T* dst = new_buffer;
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::insert(
+        paranoid_vector<T, Policy>::const_iterator pos,
+        paranoid_vector<T, Policy>::size_type count,
+        paranoid_vector<T, Policy>::const_reference val)
+{
+    MutationGuard guard(*this);
 
-    if (range1_num_elems > 0) {
-        std::uninitialized_copy_n(old_buffer, range1_num_elems, dst);
-        dst += range1_num_elems;
+    if (count == 0) {
+        return make_iterator(unwrap_iterator(pos));
     }
 
-    const iterator insertion_point = dst;
-    new (dst) T(val);
-    ++dst;
+    T* const insertion_point = relocating_insert(unwrap_iterator(pos), count, [&](T* gap) {
+        std::uninitialized_fill_n(gap, count, val);
+    });
 
-    if (range2_num_elems > 0) {
-        std::uninitialized_copy_n(old_buffer + range1_num_elems, range2_num_elems, dst);
-    }
+    return make_iterator(insertion_point);
+}
 
-    if (old_buffer) {
-        deallocate_unattached_buffer(old_buffer, PROT_NONE);
-    }
+template <typename T, typename Policy>
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::insert(
+        paranoid_vector<T, Policy>::const_iterator pos,
+        std::initializer_list<value_type> l)
+{
+    return insert(pos, l.begin(), l.end());
+}
 
-    set_attached_buffer(new_buffer, new_num_elem);
+template <typename T, typename Policy>
+template< class... Args >
+typename paranoid_vector<T, Policy>::iterator paranoid_vector<T, Policy>::emplace(
+        paranoid_vector<T, Policy>::const_iterator pos,
+        Args&&... args)
+{
+    MutationGuard guard(*this);
 
-    return insertion_point;
+    T* const insertion_point = relocating_insert(unwrap_iterator(pos), 1, [&](T* gap) {
+        new (gap) T(std::forward<Args>(args)...);
+    });
+
+    return make_iterator(insertion_point);
 }
 
+// The vector type that T's checking policy selects: std::vector<T> for
+// paranoia_passthrough, and paranoid_vector<T, Policy> otherwise.
+template <typename T, typename Policy = typename paranoia_check_policy_for<T>::type>
+using paranoid_vector_t = typename std::conditional<
+    std::is_same<Policy, paranoia_passthrough>::value,
+    std::vector<T>,
+    paranoid_vector<T, Policy>>::type;
+
 #define DECLARE_PARANOID_VECTOR_SPECIALIZATION(ELEM_TYPE) \
 namespace std { \
     extern template class vector< ELEM_TYPE , allocator< ELEM_TYPE  > >; \
@@ -847,8 +1818,10 @@ namespace std { \
                 vector(size_t pool_preferred_max_size_bytes)                                           : base_class(pool_preferred_max_size_bytes) {} \
                 vector(std::shared_ptr<allocator_type> allocator = std::make_shared<allocator_type>()) : base_class(allocator) {} \
                 vector(const vector<value_type>& other)                                            : base_class(other) {} \
+                vector(vector<value_type>&& other) noexcept                                        : base_class(std::move(other)) {} \
                 vector(std::initializer_list<value_type> l)                                            : base_class(l) {} \
                 vector& operator=( const vector& other ) { base_class::operator=(other); return *this; } \
+                vector& operator=( vector&& other ) noexcept { base_class::operator=(std::move(other)); return *this; } \
  \
                 int foozle; \
         }; \
@@ -21,5 +21,17 @@ T checked_cast(long val) {
 
 size_t get_page_size();
 
+// The size of a PMD-mapped transparent huge page, or 0 if the kernel doesn't
+// support them.
+size_t get_huge_page_size();
+
+// Like memcpy, but copies of at least PARANOIA_STREAMING_COPY_MIN_BYTES bypass
+// the cache (where the CPU supports non-temporal stores), so that relocating a
+// large buffer doesn't evict the rest of the working set.
+// The ranges must not overlap.
+void paranoia_bulk_copy(void* dst, const void* src, size_t num_bytes);
+
+const size_t PARANOIA_STREAMING_COPY_MIN_BYTES = 4 * 1024 * 1024;
+
 long get_vm_max_map_count();
 
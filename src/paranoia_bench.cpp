@@ -0,0 +1,302 @@
+// Microbenchmarks comparing paranoid_vector against std::vector, both with
+// paranoia_allocator and with the default allocator.
+//
+// Usage: paranoia-bench [--quick] [--reps N] [--output FILE]
+//
+// Results are written as JSON (to stdout unless --output is given): one record
+// per (container, element size, length, pool budget, operation), with
+// throughput and per-call latency percentiles.
+
+#include "util.h"
+#include "paranoia_pool.h"
+#include "paranoia_allocator.h"
+#include "paranoid_vector.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+template <size_t N>
+struct Elem {
+    unsigned char bytes[N];
+
+    Elem() = default;
+
+    explicit Elem(size_t x) {
+        std::memset(bytes, int(x & 0xff), N);
+    }
+};
+
+struct BenchConfig {
+    size_t reps = 5;
+    vector<size_t> lengths = {1000, 100000};
+    vector<size_t> pool_max_bytes = {size_t(64) << 20, size_t(1) << 30};
+    size_t pool_max_allocs = 10000;
+
+    // insert / erase relocate the whole buffer for paranoid containers, so
+    // only time a bounded number of calls.
+    size_t max_insert_erase_calls = 100;
+};
+
+struct BenchResult {
+    string container;
+    size_t elem_bytes;
+    size_t length;
+    size_t pool_max_bytes; // 0 when the container doesn't use a pool.
+    string op;
+
+    vector<double> latencies_ns; // One per timed call.
+    size_t elems_processed = 0;
+};
+
+double elapsed_ns(Clock::time_point t0, Clock::time_point t1) {
+    return std::chrono::duration<double, std::nano>(t1 - t0).count();
+}
+
+// Keeps the optimizer from discarding the loops we're timing.
+volatile size_t g_sink;
+
+template <typename Vec, typename E>
+void fill(Vec & v, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        v.push_back(E(i));
+    }
+}
+
+template <typename Vec, typename E>
+void run_ops(
+        const BenchConfig & config,
+        const function<Vec()> & make_vec,
+        BenchResult proto,
+        vector<BenchResult> & results)
+{
+    const size_t length = proto.length;
+
+    {
+        BenchResult r = proto;
+        r.op = "push_back";
+        for (size_t rep = 0; rep < config.reps; ++rep) {
+            Vec v = make_vec();
+            for (size_t i = 0; i < length; ++i) {
+                const E e(i);
+                const auto t0 = Clock::now();
+                v.push_back(e);
+                r.latencies_ns.push_back(elapsed_ns(t0, Clock::now()));
+            }
+            r.elems_processed += length;
+        }
+        results.push_back(r);
+    }
+
+    {
+        BenchResult r = proto;
+        r.op = "iterate";
+        Vec v = make_vec();
+        fill<Vec, E>(v, length);
+        for (size_t rep = 0; rep < config.reps; ++rep) {
+            const auto t0 = Clock::now();
+            size_t sum = 0;
+            for (size_t i = 0; i < length; ++i) {
+                sum += v[i].bytes[0];
+            }
+            r.latencies_ns.push_back(elapsed_ns(t0, Clock::now()));
+            g_sink = sum;
+            r.elems_processed += length;
+        }
+        results.push_back(r);
+    }
+
+    {
+        BenchResult r = proto;
+        r.op = "copy";
+        Vec v = make_vec();
+        fill<Vec, E>(v, length);
+        for (size_t rep = 0; rep < config.reps; ++rep) {
+            const auto t0 = Clock::now();
+            Vec c(v);
+            r.latencies_ns.push_back(elapsed_ns(t0, Clock::now()));
+            g_sink = c.size();
+            r.elems_processed += length;
+        }
+        results.push_back(r);
+    }
+
+    const size_t num_calls = std::min(length, config.max_insert_erase_calls);
+
+    {
+        BenchResult r = proto;
+        r.op = "insert";
+        for (size_t rep = 0; rep < config.reps; ++rep) {
+            Vec v = make_vec();
+            fill<Vec, E>(v, length);
+            for (size_t i = 0; i < num_calls; ++i) {
+                const E e(i);
+                const auto t0 = Clock::now();
+                v.insert(v.begin() + v.size() / 2, e);
+                r.latencies_ns.push_back(elapsed_ns(t0, Clock::now()));
+            }
+            r.elems_processed += num_calls;
+        }
+        results.push_back(r);
+    }
+
+    {
+        BenchResult r = proto;
+        r.op = "erase";
+        for (size_t rep = 0; rep < config.reps; ++rep) {
+            Vec v = make_vec();
+            fill<Vec, E>(v, length);
+            for (size_t i = 0; i < num_calls; ++i) {
+                const auto t0 = Clock::now();
+                v.erase(v.begin() + v.size() / 2);
+                r.latencies_ns.push_back(elapsed_ns(t0, Clock::now()));
+            }
+            r.elems_processed += num_calls;
+        }
+        results.push_back(r);
+    }
+}
+
+template <size_t N>
+void run_elem_size(const BenchConfig & config, vector<BenchResult> & results)
+{
+    using E = Elem<N>;
+
+    for (const size_t length : config.lengths) {
+        for (const size_t pool_max_bytes : config.pool_max_bytes) {
+            auto ppool = std::make_shared<ParanoiaPool>(pool_max_bytes, config.pool_max_allocs);
+            auto allocator = std::make_shared<paranoia_allocator<E>>(ppool);
+
+            BenchResult proto;
+            proto.elem_bytes = N;
+            proto.length = length;
+            proto.pool_max_bytes = pool_max_bytes;
+
+            proto.container = "paranoid_vector";
+            run_ops<paranoid_vector<E>, E>(
+                    config,
+                    [&]() { return paranoid_vector<E>(allocator); },
+                    proto, results);
+
+            proto.container = "std::vector<paranoia_allocator>";
+            run_ops<std::vector<E, paranoia_allocator<E>>, E>(
+                    config,
+                    [&]() { return std::vector<E, paranoia_allocator<E>>(*allocator); },
+                    proto, results);
+        }
+
+        BenchResult proto;
+        proto.elem_bytes = N;
+        proto.length = length;
+        proto.pool_max_bytes = 0;
+        proto.container = "std::vector";
+        run_ops<std::vector<E>, E>(
+                config,
+                []() { return std::vector<E>(); },
+                proto, results);
+    }
+}
+
+double percentile(const vector<double> & sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    const size_t i = std::min(sorted.size() - 1, size_t(p * double(sorted.size())));
+    return sorted[i];
+}
+
+void write_json(ostream & os, const vector<BenchResult> & results) {
+    os << "{\n  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult & r = results[i];
+
+        vector<double> sorted = r.latencies_ns;
+        std::sort(sorted.begin(), sorted.end());
+
+        double total_ns = 0;
+        for (const double x : sorted) {
+            total_ns += x;
+        }
+
+        const double elems_per_sec = (total_ns > 0) ? (double(r.elems_processed) * 1e9 / total_ns) : 0;
+
+        os << (i ? "," : "") << "\n    {"
+           << "\"container\": \"" << r.container << "\", "
+           << "\"elem_bytes\": " << r.elem_bytes << ", "
+           << "\"length\": " << r.length << ", "
+           << "\"pool_max_bytes\": " << r.pool_max_bytes << ", "
+           << "\"op\": \"" << r.op << "\", "
+           << "\"calls\": " << sorted.size() << ", "
+           << "\"elems_per_sec\": " << elems_per_sec << ", "
+           << "\"latency_ns\": {"
+           << "\"min\": " << percentile(sorted, 0) << ", "
+           << "\"p50\": " << percentile(sorted, 0.50) << ", "
+           << "\"p90\": " << percentile(sorted, 0.90) << ", "
+           << "\"p99\": " << percentile(sorted, 0.99) << ", "
+           << "\"max\": " << (sorted.empty() ? 0 : sorted.back())
+           << "}}";
+    }
+
+    os << "\n  ]\n}\n";
+}
+
+void usage(const char* argv0) {
+    cerr << "Usage: " << argv0 << " [--quick] [--reps N] [--output FILE]" << endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    string output_path;
+
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--quick") {
+            config.reps = 2;
+            config.lengths = {1000};
+            config.pool_max_bytes = {size_t(64) << 20};
+        }
+        else if ((arg == "--reps") && (i + 1 < argc)) {
+            config.reps = std::stoul(argv[++i]);
+        }
+        else if ((arg == "--output") && (i + 1 < argc)) {
+            output_path = argv[++i];
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    vector<BenchResult> results;
+    run_elem_size<8>(config, results);
+    run_elem_size<64>(config, results);
+    run_elem_size<256>(config, results);
+
+    if (output_path.empty()) {
+        write_json(cout, results);
+    }
+    else {
+        ofstream out(output_path);
+        out.exceptions(ostream::failbit | ostream::badbit);
+        write_json(out, results);
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "paranoia_checked_iterator.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+using namespace std;
+
+// Control blocks are carved out of slabs of this many, and never freed.
+static const size_t CONTROL_SLAB_SIZE = 256;
+
+static std::mutex g_control_mutex;
+static ParanoiaIteratorControl* g_free_controls = nullptr;
+
+ParanoiaIteratorControl* paranoia_acquire_iterator_control()
+{
+    std::lock_guard<std::mutex> lock(g_control_mutex);
+
+    if (! g_free_controls) {
+        ParanoiaIteratorControl* const slab = new ParanoiaIteratorControl[CONTROL_SLAB_SIZE];
+        for (size_t i = 0; i < CONTROL_SLAB_SIZE; ++i) {
+            slab[i].next_free = g_free_controls;
+            g_free_controls = &(slab[i]);
+        }
+    }
+
+    ParanoiaIteratorControl* const control = g_free_controls;
+    g_free_controls = control->next_free;
+    control->next_free = nullptr;
+    return control;
+}
+
+void paranoia_release_iterator_control(ParanoiaIteratorControl* control)
+{
+    if (! control) {
+        return;
+    }
+
+    control->invalidate_iterators();
+
+    std::lock_guard<std::mutex> lock(g_control_mutex);
+    control->next_free = g_free_controls;
+    g_free_controls = control;
+}
+
+void paranoia_report_stale_iterator(
+        const void* p,
+        uint64_t iterator_generation,
+        uint64_t current_generation)
+{
+    std::fprintf(stderr,
+            "paranoid_vector: dereferenced an invalidated iterator (address %p, generation %" PRIu64
+            ", vector is now at generation %" PRIu64 ").\n",
+            p, iterator_generation, current_generation);
+    std::abort();
+}
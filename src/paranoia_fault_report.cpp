@@ -0,0 +1,459 @@
+// ParanoiaPool's optional use-after-free reporting: call-stack capture, and the
+// SIGSEGV handler that explains faults in pool buffers.
+
+#include "paranoia_pool.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+// Pools with fault reporting enabled.  The signal handler can't take locks,
+// so this is a fixed array of atomic slots.
+static const size_t MAX_FAULT_REPORTING_POOLS = 64;
+static std::atomic<ParanoiaPool*> g_fault_reporting_pools[MAX_FAULT_REPORTING_POOLS];
+
+static std::once_flag g_fault_handler_installed;
+static struct sigaction g_prev_segv_action;
+
+// Builds the report in a stack buffer and writes it straight to stderr.  The
+// report is written from a signal handler, so this makes only
+// async-signal-safe calls: no stdio, no locale, no allocation.  The buffer is
+// flushed when the writer goes out of scope, so one statement is one write.
+class SignalSafeWriter {
+    public:
+        SignalSafeWriter() = default;
+        SignalSafeWriter(const SignalSafeWriter &) = delete;
+        SignalSafeWriter & operator=(const SignalSafeWriter &) = delete;
+
+        ~SignalSafeWriter() {
+            flush();
+        }
+
+        SignalSafeWriter & operator<<(const char* s) {
+            while (*s) {
+                put(*s++);
+            }
+            return *this;
+        }
+
+        // Decimal.
+        SignalSafeWriter & operator<<(size_t n) {
+            char digits[20];
+            size_t num_digits = 0;
+            do {
+                digits[num_digits++] = char('0' + n % 10);
+                n /= 10;
+            } while (n);
+
+            while (num_digits) {
+                put(digits[--num_digits]);
+            }
+            return *this;
+        }
+
+        // Hex, with a 0x prefix.
+        SignalSafeWriter & operator<<(const void* p) {
+            return hex(reinterpret_cast<uintptr_t>(p));
+        }
+
+        SignalSafeWriter & hex(uintptr_t n) {
+            char digits[2 * sizeof(n)];
+            size_t num_digits = 0;
+            do {
+                digits[num_digits++] = "0123456789abcdef"[n & 0xf];
+                n >>= 4;
+            } while (n);
+
+            put('0');
+            put('x');
+            while (num_digits) {
+                put(digits[--num_digits]);
+            }
+            return *this;
+        }
+
+        void write_bytes(const char* s, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                put(s[i]);
+            }
+        }
+
+    private:
+        char buf_[512];
+        size_t len_ = 0;
+
+        void put(char c) {
+            if (len_ == sizeof(buf_)) {
+                flush();
+            }
+            buf_[len_++] = c;
+        }
+
+        void flush() {
+            size_t done = 0;
+            while (done < len_) {
+                const ssize_t n = write(STDERR_FILENO, buf_ + done, len_ - done);
+                if (n <= 0) {
+                    if ((n < 0) && (errno == EINTR)) {
+                        continue;
+                    }
+                    break;
+                }
+                done += size_t(n);
+            }
+            len_ = 0;
+        }
+};
+
+static void report_stack(const char* title, const void* stack_frames, size_t num_frames)
+{
+    void* const* const frames = static_cast<void* const*>(stack_frames);
+
+    // Symbolizing would take the dynamic loader's lock, which the faulting
+    // thread may hold, so just print the return addresses.
+    SignalSafeWriter w;
+    w << "  " << title << ":\n";
+    for (size_t i = 0; i < num_frames; ++i) {
+        w << "    #" << i << " " << static_cast<const void*>(frames[i]) << "\n";
+    }
+}
+
+// Prints the lines of /proc/self/maps for executable mappings, so the return
+// addresses in a report can be symbolized offline.
+static void report_executable_mappings()
+{
+    int fd;
+    do {
+        fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    } while ((fd < 0) && (errno == EINTR));
+
+    if (fd < 0) {
+        return;
+    }
+
+    SignalSafeWriter w;
+    w << "  executable mappings:\n";
+
+    // Each line is "start-end perms offset dev inode path".  Over-long lines
+    // are truncated.
+    char line[512];
+    size_t line_len = 0;
+    bool line_truncated = false;
+
+    char buf[1024];
+    for (;;) {
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        for (ssize_t i = 0; i < n; ++i) {
+            if (buf[i] != '\n') {
+                if (line_len < sizeof(line)) {
+                    line[line_len++] = buf[i];
+                } else {
+                    line_truncated = true;
+                }
+                continue;
+            }
+
+            const char* const perms = static_cast<const char*>(memchr(line, ' ', line_len));
+            if (perms && (perms + 4 < line + line_len) && (perms[3] == 'x')) {
+                w << "    ";
+                w.write_bytes(line, line_len);
+                w << (line_truncated ? "...\n" : "\n");
+            }
+
+            line_len = 0;
+            line_truncated = false;
+        }
+    }
+
+    close(fd);
+}
+
+void ParanoiaPool::capture_stack(CapturedStack & stack)
+{
+    stack.num_frames = 0;
+
+#if defined(__x86_64__) || defined(__aarch64__)
+    // Only follow frame pointers that stay within this thread's stack, so a
+    // frame built without one ends the walk instead of crashing it.
+    thread_local uintptr_t stack_lo = 0;
+    thread_local uintptr_t stack_hi = 0;
+
+    if (stack_hi == 0) {
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            void* addr;
+            size_t num_bytes;
+            if (pthread_attr_getstack(&attr, &addr, &num_bytes) == 0) {
+                stack_lo = reinterpret_cast<uintptr_t>(addr);
+                stack_hi = stack_lo + num_bytes;
+            }
+            pthread_attr_destroy(&attr);
+        }
+
+        if (stack_hi == 0) {
+            // Don't ask again; just capture nothing.
+            stack_hi = 1;
+        }
+    }
+
+    // Each frame starts with the caller's frame pointer, then the return
+    // address.
+    uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+
+    while ((stack.num_frames < MAX_STACK_FRAMES) &&
+            (fp >= stack_lo) &&
+            (fp + 2 * sizeof(void*) <= stack_hi) &&
+            (fp % sizeof(void*) == 0))
+    {
+        void* const* const frame = reinterpret_cast<void* const*>(fp);
+        if (! frame[1]) {
+            break;
+        }
+
+        stack.frames[stack.num_frames++] = frame[1];
+
+        const uintptr_t next_fp = reinterpret_cast<uintptr_t>(frame[0]);
+        if (next_fp <= fp) {
+            break;
+        }
+        fp = next_fp;
+    }
+#endif
+}
+
+uint64_t ParanoiaPool::store_stack_locked(Shard & shard, const CapturedStack & stack)
+{
+    if (shard.stack_records.empty()) {
+        shard.stack_records.assign(num_stack_records_.load(), StackRecord{0, CapturedStack()});
+    }
+
+    const uint64_t seq = shard.next_stack_seq++;
+    StackRecord & record = shard.stack_records[seq % shard.stack_records.size()];
+    record.seq = seq;
+    record.stack = stack;
+    return seq;
+}
+
+const ParanoiaPool::CapturedStack* ParanoiaPool::find_stack_locked(const Shard & shard, uint64_t seq) const
+{
+    if ((seq == 0) || shard.stack_records.empty()) {
+        return nullptr;
+    }
+
+    const StackRecord & record = shard.stack_records[seq % shard.stack_records.size()];
+    return (record.seq == seq) ? &(record.stack) : nullptr;
+}
+
+void ParanoiaPool::enable_fault_reporting(size_t num_stack_records)
+{
+    assert(num_stack_records > 0);
+
+    // Each shard gets its own ring, but only once it records a stack.
+    size_t expected = 0;
+    if (! num_stack_records_.compare_exchange_strong(expected, num_stack_records)) {
+        return;
+    }
+
+    register_fault_reporting_pool(this);
+    fault_reporting_enabled_.store(true);
+
+    std::call_once(g_fault_handler_installed, []() {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = fault_handler;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+
+        if (sigaction(SIGSEGV, &action, &g_prev_segv_action)) {
+            const string e = std::strerror(errno);
+            ostringstream os;
+            os << "Failed call to sigaction: " << e;
+            throw std::runtime_error(os.str());
+        }
+    });
+}
+
+void ParanoiaPool::register_fault_reporting_pool(ParanoiaPool* pool)
+{
+    for (size_t i = 0; i < MAX_FAULT_REPORTING_POOLS; ++i) {
+        ParanoiaPool* expected = nullptr;
+        if (g_fault_reporting_pools[i].compare_exchange_strong(expected, pool)) {
+            return;
+        }
+    }
+
+    throw std::runtime_error("Too many ParanoiaPools with fault reporting enabled.");
+}
+
+void ParanoiaPool::unregister_fault_reporting_pool(ParanoiaPool* pool)
+{
+    for (size_t i = 0; i < MAX_FAULT_REPORTING_POOLS; ++i) {
+        ParanoiaPool* expected = pool;
+        g_fault_reporting_pools[i].compare_exchange_strong(expected, nullptr);
+    }
+}
+
+bool ParanoiaPool::report_fault(const char* addr)
+{
+    Shard* const shard = find_shard(addr);
+    if (! shard) {
+        return false;
+    }
+
+    // If the faulting thread was itself inside the pool, the shard may be
+    // half-updated, and its mutex will never be released.
+    if (pthread_equal(shard->owner.load(), pthread_self())) {
+        SignalSafeWriter() << "paranoia: SIGSEGV at " << static_cast<const void*>(addr)
+            << ", while this thread was updating pool " << static_cast<const void*>(this)
+            << ", so the buffer can't be identified.\n";
+        return true;
+    }
+
+    // Another thread may hold the shard's mutex for a moment.  Give it a few
+    // milliseconds, but no more: it may be waiting on something this thread
+    // holds.
+    bool locked = shard->mutex.try_lock();
+    for (int i = 0; (i < 10) && (! locked); ++i) {
+        const struct timespec delay = {0, 1000 * 1000};
+        nanosleep(&delay, nullptr);
+        locked = shard->mutex.try_lock();
+    }
+
+    if (! locked) {
+        SignalSafeWriter() << "paranoia: SIGSEGV at " << static_cast<const void*>(addr)
+            << "; pool " << static_cast<const void*>(this)
+            << " is busy, so the buffer can't be identified.\n";
+        return true;
+    }
+
+    // Holding the mutex keeps other threads from changing the shard while we
+    // walk it.
+    std::lock_guard<std::mutex> lock(shard->mutex, std::adopt_lock);
+
+    const AllocDetails* found = nullptr;
+    const char* state = nullptr;
+
+    // Newest first, in case the range has been reused since.
+    for (auto iter = shard->stale_allocs.rbegin(); iter != shard->stale_allocs.rend(); ++iter) {
+        const char* const base = static_cast<const char*>(iter->addr);
+        if ((addr >= base) && (addr < base + iter->num_bytes)) {
+            found = &(*iter);
+            state = "freed (quarantined) buffer";
+            break;
+        }
+    }
+
+    if (! found) {
+        shard->live_allocs.for_each([&](const AllocDetails & details) {
+            const char* const base = static_cast<const char*>(details.addr);
+            if ((addr >= base) && (addr < base + details.num_bytes)) {
+                found = &details;
+                state = "live buffer, outside its accessible pages";
+            }
+        });
+    }
+
+    if (! found) {
+        SignalSafeWriter() << "paranoia: SIGSEGV at " << static_cast<const void*>(addr)
+            << ", in pool " << static_cast<const void*>(this)
+            << " address space that no buffer currently occupies"
+            << " (its buffer was evicted from quarantine).\n";
+        return true;
+    }
+
+    SignalSafeWriter() << "paranoia: SIGSEGV at " << static_cast<const void*>(addr)
+        << ", " << size_t(addr - static_cast<const char*>(found->addr)) << " bytes into a " << state
+        << ": addr=" << static_cast<const void*>(found->addr)
+        << " num_bytes=" << found->num_bytes
+        << " accessible_bytes=" << ((found->prot == PROT_NONE) ? size_t(0) : found->num_prefix_bytes)
+        << "\n";
+
+    bool reported_stack = false;
+
+    const CapturedStack* const alloc_stack = find_stack_locked(*shard, found->alloc_stack_seq);
+    if (alloc_stack) {
+        report_stack("allocated at", alloc_stack->frames, alloc_stack->num_frames);
+        reported_stack = true;
+    }
+    else {
+        SignalSafeWriter() << "  allocation stack not available\n";
+    }
+
+    if (found->free_stack_seq != 0) {
+        const CapturedStack* const free_stack = find_stack_locked(*shard, found->free_stack_seq);
+        if (free_stack) {
+            report_stack("freed at", free_stack->frames, free_stack->num_frames);
+            reported_stack = true;
+        }
+        else {
+            SignalSafeWriter() << "  free stack not available\n";
+        }
+    }
+
+    if (reported_stack) {
+        report_executable_mappings();
+    }
+
+    return true;
+}
+
+void ParanoiaPool::fault_handler(int sig, siginfo_t* info, void* context)
+{
+    const char* const addr = static_cast<const char*>(info->si_addr);
+    const int saved_errno = errno;
+
+    bool reported = false;
+    for (size_t i = 0; (i < MAX_FAULT_REPORTING_POOLS) && (! reported); ++i) {
+        ParanoiaPool* const pool = g_fault_reporting_pools[i].load();
+        reported = pool && pool->report_fault(addr);
+    }
+
+    // A fault outside our pools goes to whatever handled SIGSEGV before us, as
+    // if we'd never been installed.  If that's a function, call it and stay
+    // installed.
+    if (! reported) {
+        if (g_prev_segv_action.sa_flags & SA_SIGINFO) {
+            g_prev_segv_action.sa_sigaction(sig, info, context);
+            errno = saved_errno;
+            return;
+        }
+
+        if ((g_prev_segv_action.sa_handler != SIG_DFL) && (g_prev_segv_action.sa_handler != SIG_IGN)) {
+            g_prev_segv_action.sa_handler(sig);
+            errno = saved_errno;
+            return;
+        }
+    }
+
+    // The process is about to die.  Put back the previous action; returning
+    // re-executes the faulting access, which then gets the usual treatment
+    // (e.g. a core dump).  A SIGSEGV sent with kill() won't recur on its own,
+    // so send it again; it's delivered once this handler returns.
+    sigaction(SIGSEGV, &g_prev_segv_action, nullptr);
+    if (info->si_code <= 0) {
+        raise(sig);
+    }
+
+    errno = saved_errno;
+}
@@ -0,0 +1,168 @@
+#include "paranoia_parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct ParallelJob {
+    ParallelJob(size_t num_tasks, const std::function<void(size_t)> & fn)
+        : num_tasks(num_tasks), fn(fn)
+    {
+    }
+
+    const size_t num_tasks;
+    const std::function<void(size_t)> & fn;
+
+    std::atomic<size_t> next_task{0};
+
+    // These are guarded by ParallelWorkers::mutex_.
+    size_t num_tasks_done = 0;
+    size_t num_workers_attached = 0;
+};
+
+class ParallelWorkers {
+    public:
+        ParallelWorkers()
+        {
+            const size_t num_cores = std::max(1u, std::thread::hardware_concurrency());
+            const size_t num_workers = std::min(num_cores, PARANOIA_MAX_PARALLEL_THREADS) - 1;
+
+            for (size_t i = 0; i < num_workers; ++i) {
+                threads_.emplace_back([this]() { worker_loop(); });
+            }
+        }
+
+        ~ParallelWorkers()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            work_cv_.notify_all();
+
+            for (auto & t : threads_) {
+                t.join();
+            }
+        }
+
+        size_t num_threads() const
+        {
+            return threads_.size() + 1;
+        }
+
+        void run(ParallelJob & job)
+        {
+            if (! threads_.empty()) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    jobs_.push_back(&job);
+                }
+                work_cv_.notify_all();
+            }
+
+            const size_t num_done = run_tasks(job);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            job.num_tasks_done += num_done;
+            forget_job_locked(job);
+
+            // Workers may still be running tasks, or about to look for one.
+            done_cv_.wait(lock, [&]() {
+                return (job.num_tasks_done == job.num_tasks) && (job.num_workers_attached == 0);
+            });
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable work_cv_;
+        std::condition_variable done_cv_;
+
+        // Jobs that may still have unclaimed tasks.
+        std::deque<ParallelJob*> jobs_;
+        bool stopping_ = false;
+
+        std::vector<std::thread> threads_;
+
+        static size_t run_tasks(ParallelJob & job)
+        {
+            size_t num_done = 0;
+            for (size_t i = job.next_task++; i < job.num_tasks; i = job.next_task++) {
+                job.fn(i);
+                ++num_done;
+            }
+            return num_done;
+        }
+
+        void forget_job_locked(ParallelJob & job)
+        {
+            const auto iter = std::find(jobs_.begin(), jobs_.end(), &job);
+            if (iter != jobs_.end()) {
+                jobs_.erase(iter);
+            }
+        }
+
+        void worker_loop()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            while (true) {
+                work_cv_.wait(lock, [&]() { return stopping_ || (! jobs_.empty()); });
+                if (stopping_) {
+                    return;
+                }
+
+                ParallelJob & job = *(jobs_.front());
+                ++job.num_workers_attached;
+
+                lock.unlock();
+                const size_t num_done = run_tasks(job);
+                lock.lock();
+
+                // Every task has been claimed by now, so nobody else needs to
+                // find this job.
+                forget_job_locked(job);
+
+                job.num_tasks_done += num_done;
+                --job.num_workers_attached;
+                if ((job.num_tasks_done == job.num_tasks) && (job.num_workers_attached == 0)) {
+                    done_cv_.notify_all();
+                }
+            }
+        }
+};
+
+ParallelWorkers & get_workers()
+{
+    static ParallelWorkers workers;
+    return workers;
+}
+
+}
+
+void paranoia_parallel_for(size_t num_tasks, const std::function<void(size_t)> & fn)
+{
+    if (num_tasks == 0) {
+        return;
+    }
+
+    if (num_tasks == 1) {
+        fn(0);
+        return;
+    }
+
+    ParallelJob job(num_tasks, fn);
+    get_workers().run(job);
+}
+
+size_t paranoia_parallel_num_threads()
+{
+    return get_workers().num_threads();
+}
@@ -3,11 +3,15 @@
 #include "util.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <algorithm>
+#include <limits>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
@@ -17,61 +21,417 @@
 
 using namespace std;
 
-static const size_t BILLION = 1000 * 1000  * 1000;
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+static const size_t GIBIBYTE = size_t(1) << 30;
+
+// Reserving address space is nearly free (the region is PROT_NONE and
+// MAP_NORESERVE), so we ask for it in big pieces.
+static const size_t ARENA_REGION_BYTES = 64 * GIBIBYTE;
 
 static size_t get_ideal_max_allocs()
 {
+    // Each buffer can split its arena region's VMA in up to three places: at
+    // its start and end (where its protection or madvise flags differ from
+    // its neighbours'), and where a live buffer's accessible prefix gives way
+    // to its PROT_NONE spare capacity.  Running out of VMAs makes mmap /
+    // mprotect fail with ENOMEM, so budget for the worst case.
     const long max_map_count = get_vm_max_map_count();
-    const long ideal_max = max_map_count / 2;
+    const long ideal_max = max_map_count / 3;
     return checked_cast<size_t>(ideal_max);
 }
 
-static const size_t GLOBAL_DEFAULT_POOL_IDEAL_MAX_BYTES = 25*BILLION;
+// Quarantined buffers hold no physical memory, so this mainly bounds the
+// address space (and the page tables covering it) that the default pool keeps
+// reserved: one arena region's worth.
+static const size_t GLOBAL_DEFAULT_POOL_IDEAL_MAX_BYTES = ARENA_REGION_BYTES;
 static const size_t GLOBAL_DEFAULT_POOL_IDEAL_MAX_ALLOCS = get_ideal_max_allocs();
 static const size_t PAGE_SIZE = get_page_size();
+static const size_t HUGE_PAGE_SIZE = get_huge_page_size();
 
 const std::shared_ptr<ParanoiaPool> g_paranoia_default_pool = make_shared<ParanoiaPool>(
         GLOBAL_DEFAULT_POOL_IDEAL_MAX_BYTES,
         GLOBAL_DEFAULT_POOL_IDEAL_MAX_ALLOCS);
 
+class ParanoiaPool::ShardLock {
+    public:
+        explicit ShardLock(Shard & shard) :
+            shard_(shard)
+        {
+            shard_.mutex.lock();
+            shard_.owner.store(pthread_self());
+        }
+
+        ~ShardLock() {
+            shard_.owner.store(pthread_t());
+            shard_.mutex.unlock();
+        }
+
+        ShardLock(const ShardLock &) = delete;
+        ShardLock & operator=(const ShardLock &) = delete;
+
+    private:
+        Shard & shard_;
+};
+
+// Records the lifetime of the enclosing scope in a latency histogram.
+class ScopedLatency {
+    public:
+        explicit ScopedLatency(ParanoiaAtomicLatencyHistogram & histogram)
+            : histogram_(histogram), t0_(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~ScopedLatency() {
+            const auto t1 = std::chrono::steady_clock::now();
+            histogram_.record_ns(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0_).count()));
+        }
+
+    private:
+        ParanoiaAtomicLatencyHistogram & histogram_;
+        const std::chrono::steady_clock::time_point t0_;
+};
+
+void ParanoiaPool::bump(std::atomic<uint64_t> & counter, uint64_t n) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+ParanoiaPool::Stats ParanoiaPool::get_stats() const {
+    Stats s;
+
+    // The counters only change under some shard's mutex, so holding all of
+    // them gives us a consistent set.
+    {
+        std::unique_lock<std::mutex> locks[NUM_SHARDS];
+        for (size_t i = 0; i < NUM_SHARDS; ++i) {
+            locks[i] = std::unique_lock<std::mutex>(shards_[i].mutex);
+        }
+
+        s.num_live_allocs = num_live_allocs_.load();
+        s.live_bytes = resident_bytes_.load();
+        s.num_stale_allocs = num_stale_allocs_.load();
+        s.stale_bytes = reserved_bytes_.load() - resident_bytes_.load();
+
+        s.num_mprotect_calls = stats_.num_mprotect_calls.load(std::memory_order_relaxed);
+        s.num_mmap_calls = stats_.num_mmap_calls.load(std::memory_order_relaxed);
+        s.num_munmap_calls = stats_.num_munmap_calls.load(std::memory_order_relaxed);
+        s.num_mremap_calls = stats_.num_mremap_calls.load(std::memory_order_relaxed);
+        s.num_evictions = stats_.num_evictions.load(std::memory_order_relaxed);
+        s.num_evicted_bytes = stats_.num_evicted_bytes.load(std::memory_order_relaxed);
+        s.num_alloc_failures = stats_.num_alloc_failures.load(std::memory_order_relaxed);
+
+        s.num_huge_page_allocs = num_huge_page_allocs_.load();
+        s.huge_page_alloc_bytes = huge_page_alloc_bytes_.load();
+    }
+
+    s.huge_page_backed_bytes = (s.num_huge_page_allocs > 0) ? read_huge_page_backed_bytes() : 0;
+
+    s.allocate_latency = stats_.allocate_latency.snapshot();
+    s.deallocate_latency = stats_.deallocate_latency.snapshot();
+    s.set_prot_latency = stats_.set_prot_latency.snapshot();
+
+    return s;
+}
 
 ParanoiaPool::AllocDetails::AllocDetails(
         void* addr,
         size_t num_bytes,
         int prot)
-    : addr(addr), num_bytes(num_bytes), prot(prot)
+    : addr(addr), num_bytes(num_bytes), prot(prot), num_prefix_bytes(num_bytes),
+      alloc_stack_seq(0), free_stack_seq(0), huge_pages(false)
 {
 }
 
+size_t ParanoiaPool::get_page_size()
+{
+    return PAGE_SIZE;
+}
+
 void ParanoiaPool::set_preferred_max_bytes(size_t num_bytes)
 {
-    preferred_max_bytes_ = num_bytes;
-    gc_as_needed(0);
+    preferred_max_bytes_.store(num_bytes);
+    gc_as_needed(0, 0, home_shard_index());
+}
+
+void ParanoiaPool::set_huge_page_min_bytes(size_t num_bytes)
+{
+    huge_page_min_bytes_.store(num_bytes);
+}
+
+void ParanoiaPool::set_huge_page_collapse(bool enabled)
+{
+    huge_page_collapse_.store(enabled);
+}
+
+void ParanoiaPool::set_parallel_min_bytes(size_t num_bytes)
+{
+    parallel_min_bytes_.store(num_bytes);
+}
+
+size_t ParanoiaPool::get_parallel_min_bytes() const
+{
+    return parallel_min_bytes_.load();
+}
+
+size_t ParanoiaPool::buffer_num_bytes(size_t num_bytes, bool & huge_pages) const
+{
+    huge_pages = (HUGE_PAGE_SIZE > PAGE_SIZE) && (num_bytes >= huge_page_min_bytes_.load());
+    if (! huge_pages) {
+        return num_bytes;
+    }
+
+    return ((num_bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+}
+
+void ParanoiaPool::collapse_completed_huge_page(
+        const AllocDetails & details,
+        size_t old_open_bytes,
+        size_t new_open_bytes) const
+{
+    // Huge pages wholly past the old prefix were opened in one go, so the
+    // kernel can fault them in huge.  But the one the old prefix ended in
+    // has been faulted in as small pages.
+    if ((! details.huge_pages) || (old_open_bytes % HUGE_PAGE_SIZE == 0) ||
+            (! huge_page_collapse_.load(std::memory_order_relaxed)))
+    {
+        return;
+    }
+
+    const size_t offset = old_open_bytes - (old_open_bytes % HUGE_PAGE_SIZE);
+    if (offset + HUGE_PAGE_SIZE > new_open_bytes) {
+        return;
+    }
+
+    // Only a hint: older kernels don't know MADV_COLLAPSE, and it can fail
+    // for lack of free huge pages.
+    madvise(static_cast<char*>(details.addr) + offset, HUGE_PAGE_SIZE, MADV_COLLAPSE);
+}
+
+size_t ParanoiaPool::read_huge_page_backed_bytes() const
+{
+    ifstream in("/proc/self/smaps");
+
+    size_t num_bytes = 0;
+    bool in_pool = false;
+    string line;
+
+    while (std::getline(in, line)) {
+        // Each mapping's header line is followed by its fields.
+        unsigned long start;
+        unsigned long end;
+        size_t num_kib;
+
+        if (sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2) {
+            in_pool = find_shard(reinterpret_cast<const void*>(start)) != nullptr;
+        }
+        else if (in_pool && (sscanf(line.c_str(), "AnonHugePages: %zu kB", &num_kib) == 1)) {
+            num_bytes += num_kib * 1024;
+        }
+    }
+
+    return num_bytes;
+}
+
+size_t ParanoiaPool::get_resident_bytes() const
+{
+    return resident_bytes_.load();
+}
+
+size_t ParanoiaPool::get_reserved_bytes() const
+{
+    return reserved_bytes_.load();
+}
+
+static size_t saturating_mul(size_t a, size_t b)
+{
+    if ((a != 0) && (b > std::numeric_limits<size_t>::max() / a)) {
+        return std::numeric_limits<size_t>::max();
+    }
+    return a * b;
+}
+
+static size_t saturating_sub(size_t a, size_t b)
+{
+    return (a > b) ? (a - b) : 0;
+}
+
+bool ParanoiaPool::over_limits(
+        size_t upcoming_alloc_bytes,
+        size_t num_upcoming_allocs,
+        size_t max_bytes,
+        size_t max_allocs) const
+{
+    const size_t num_stale_allocs = num_stale_allocs_.load();
+    const size_t num_allocs = num_live_allocs_.load() + num_stale_allocs + num_upcoming_allocs;
+
+    return (num_stale_allocs > 0) &&
+        ((reserved_bytes_.load() + upcoming_alloc_bytes > max_bytes) ||
+         (num_allocs > max_allocs));
+}
+
+void ParanoiaPool::gc_to_limits(
+        size_t upcoming_alloc_bytes,
+        size_t num_upcoming_allocs,
+        size_t max_bytes,
+        size_t max_allocs,
+        size_t first_shard)
+{
+    // Evict in small batches, so nobody waits long for a shard's mutex.
+    static const size_t GC_BATCH_SIZE = 64;
+
+    size_t shard_index = first_shard;
+    size_t num_dry_shards = 0; // Consecutive shards found with empty quarantines.
+
+    while ((num_dry_shards < NUM_SHARDS) && over_limits(upcoming_alloc_bytes, num_upcoming_allocs, max_bytes, max_allocs)) {
+        Shard & shard = shards_[shard_index];
+        size_t num_evicted = 0;
+
+        {
+            ShardLock lock(shard);
+            while ((num_evicted < GC_BATCH_SIZE) &&
+                    (! shard.stale_allocs.empty()) &&
+                    over_limits(upcoming_alloc_bytes, num_upcoming_allocs, max_bytes, max_allocs))
+            {
+                gc_one_alloc_locked(shard);
+                ++num_evicted;
+            }
+        }
+
+        num_dry_shards = (num_evicted > 0) ? 0 : (num_dry_shards + 1);
+
+        if (num_evicted < GC_BATCH_SIZE) {
+            shard_index = (shard_index + 1) % NUM_SHARDS;
+        }
+    }
+}
+
+void ParanoiaPool::gc_as_needed(size_t upcoming_alloc_bytes, size_t num_upcoming_allocs, size_t first_shard)
+{
+    const size_t preferred_max_bytes = preferred_max_bytes_.load();
+
+    if (! drain_running_.load()) {
+        gc_to_limits(upcoming_alloc_bytes, num_upcoming_allocs, preferred_max_bytes, preferred_max_allocs_, first_shard);
+        return;
+    }
+
+    // The drain thread normally keeps us within budget.  We only step in
+    // ourselves if it has fallen far behind.
+    gc_to_limits(
+            upcoming_alloc_bytes,
+            num_upcoming_allocs,
+            saturating_mul(preferred_max_bytes, HARD_LIMIT_FACTOR),
+            saturating_mul(preferred_max_allocs_, HARD_LIMIT_FACTOR),
+            first_shard);
+
+    if (over_limits(upcoming_alloc_bytes, num_upcoming_allocs, preferred_max_bytes, preferred_max_allocs_)) {
+        wake_drain_thread();
+    }
+}
+
+void ParanoiaPool::wake_drain_thread()
+{
+    // Only an idle drain thread needs waking, and it only goes idle after
+    // setting 'drain_idle_' and then seeing that we're within budget.  So
+    // either it sees our update to the totals, or we see 'drain_idle_' set.
+    if (drain_idle_.load()) {
+        {
+            std::lock_guard<std::mutex> lock(drain_mutex_);
+        }
+        drain_cv_.notify_one();
+    }
+}
+
+void ParanoiaPool::start_background_drain()
+{
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+
+    if (drain_thread_.joinable()) {
+        return;
+    }
+
+    drain_stop_ = false;
+    drain_thread_ = std::thread(&ParanoiaPool::drain_loop, this);
+    drain_running_.store(true);
 }
 
-void ParanoiaPool::gc_as_needed(size_t upcoming_alloc_bytes)
+void ParanoiaPool::stop_background_drain()
 {
-    while ((total_alloc_bytes_ + upcoming_alloc_bytes > preferred_max_bytes_) &&
-            (! stale_allocs_.empty()))
+    std::thread t;
+
     {
-        gc_one_alloc();
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        if (! drain_thread_.joinable()) {
+            return;
+        }
+
+        drain_stop_ = true;
+        drain_running_.store(false);
+        t.swap(drain_thread_);
     }
 
-    const size_t num_upcoming_allocs = live_allocs_.size() + stale_allocs_.size() + 1;
+    drain_cv_.notify_one();
+    t.join();
+}
+
+void ParanoiaPool::drain_loop()
+{
+    size_t first_shard = 0;
+
+    std::unique_lock<std::mutex> lock(drain_mutex_);
 
-    if (num_upcoming_allocs > preferred_max_allocs_) {
-        const size_t num_excess_allocs = num_upcoming_allocs - preferred_max_allocs_;
-        const size_t num_allocs_to_gc = std::min<size_t>(num_excess_allocs, stale_allocs_.size());
-        for (size_t i = 0; i < num_allocs_to_gc; ++i) {
-            gc_one_alloc();
+    while (! drain_stop_) {
+        const size_t preferred_max_bytes = preferred_max_bytes_.load();
+
+        if (! over_limits(0, 0, preferred_max_bytes, preferred_max_allocs_)) {
+            drain_idle_.store(true);
+            if (! over_limits(0, 0, preferred_max_bytes, preferred_max_allocs_)) {
+                drain_cv_.wait(lock);
+            }
+            drain_idle_.store(false);
+            continue;
         }
 
+        // gc_to_limits takes the shards' mutexes one at a time, in small
+        // batches, so request threads never wait long for one.
+        lock.unlock();
+        gc_to_limits(0, 0, preferred_max_bytes, preferred_max_allocs_, first_shard);
+        first_shard = (first_shard + 1) % NUM_SHARDS;
+        std::this_thread::yield();
+        lock.lock();
     }
 }
 
+size_t ParanoiaPool::get_drain_backlog_bytes() const
+{
+    // Only quarantined bytes can be evicted.
+    const size_t reserved_bytes = reserved_bytes_.load();
+    const size_t stale_bytes = reserved_bytes - resident_bytes_.load();
+    return std::min(saturating_sub(reserved_bytes, preferred_max_bytes_.load()), stale_bytes);
+}
+
+size_t ParanoiaPool::get_drain_backlog_allocs() const
+{
+    const size_t num_stale_allocs = num_stale_allocs_.load();
+    const size_t num_allocs = num_live_allocs_.load() + num_stale_allocs;
+    return std::min(saturating_sub(num_allocs, preferred_max_allocs_), num_stale_allocs);
+}
+
+ParanoiaPool::Shard::Shard() :
+    live_allocs(PAGE_SIZE, 64)
+{
+}
+
 ParanoiaPool::ParanoiaPool(size_t preferred_max_bytes, size_t preferred_max_allocs) :
     preferred_max_bytes_(preferred_max_bytes),
-    preferred_max_allocs_(preferred_max_allocs)
+    preferred_max_allocs_(preferred_max_allocs),
+    shards_(new Shard[NUM_SHARDS]),
+    region_dir_(new RegionDirEntry[MAX_ARENA_REGIONS])
 {
 #if PARANOIA_LOGGING
     cout << __PRETTY_FUNCTION__ << " :"
@@ -87,22 +447,97 @@ ParanoiaPool::~ParanoiaPool() {
         << endl;
 #endif
 
-    if (! live_allocs_.empty()) {
+    unregister_fault_reporting_pool(this);
+    stop_background_drain();
+
+    if (num_live_allocs_.load() > 0) {
         cerr << __PRETTY_FUNCTION__ << " :"
-            << " outstanding allocations: " << live_allocs_.size()
+            << " outstanding allocations: " << num_live_allocs_.load()
             << endl;
         assert(! "ParanoiaPool has outstanding allocations when destroyed.");
     }
 
-    while (! stale_allocs_.empty()) {
-        gc_one_alloc();
+    for (size_t i = 0; i < NUM_SHARDS; ++i) {
+        Shard & shard = shards_[i];
+        ShardLock lock(shard);
+
+        while (! shard.stale_allocs.empty()) {
+            gc_one_alloc_locked(shard);
+        }
+
+        for (const ArenaRegion & r : shard.arena_regions) {
+            bump(stats_.num_munmap_calls);
+            if (munmap(r.base, r.num_bytes)) {
+                cerr << __PRETTY_FUNCTION__ << " :"
+                    << " failed call to munmap: " << std::strerror(errno)
+                    << endl;
+            }
+        }
     }
 }
 
-void ParanoiaPool::gc_one_alloc() {
-    assert(! stale_allocs_.empty());
+size_t ParanoiaPool::home_shard_index() {
+    // Threads are dealt out to the shards round-robin, in the order they
+    // first allocate.
+    static std::atomic<size_t> next_thread_index{0};
+    thread_local const size_t index = next_thread_index.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS;
+    return index;
+}
+
+ParanoiaPool::Shard* ParanoiaPool::find_shard(const void* p) const {
+    const char* const cp = static_cast<const char*>(p);
+
+    while (true) {
+        const uint64_t seq = region_dir_seq_.load(std::memory_order_acquire);
+        if (seq & 1) {
+            // An insertion is under way; it only takes a moment.
+            continue;
+        }
 
-    AllocDetails & victim = stale_allocs_.front();
+        // Find the last region starting at or before 'cp'.
+        const size_t num_entries = num_region_dir_entries_.load(std::memory_order_relaxed);
+        size_t lo = 0;
+        size_t hi = num_entries;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (region_dir_[mid].base.load(std::memory_order_relaxed) <= cp) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+
+        Shard* shard = nullptr;
+        if (lo > 0) {
+            const RegionDirEntry & e = region_dir_[lo - 1];
+            const char* const base = e.base.load(std::memory_order_relaxed);
+            if (cp < base + e.num_bytes.load(std::memory_order_relaxed)) {
+                shard = e.shard.load(std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (region_dir_seq_.load(std::memory_order_relaxed) == seq) {
+            return shard;
+        }
+    }
+}
+
+ParanoiaPool::Shard & ParanoiaPool::owning_shard(const void* p) const {
+    Shard* const shard = find_shard(p);
+    if (! shard) {
+        assert(! "pointer not managed by this ParanoiaPool.");
+        abort();
+    }
+
+    return *shard;
+}
+
+void ParanoiaPool::gc_one_alloc_locked(Shard & shard) {
+    assert(! shard.stale_allocs.empty());
+
+    AllocDetails & victim = shard.stale_allocs.front();
 
 #if PARANOIA_LOGGING
     cout << __PRETTY_FUNCTION__ << " :"
@@ -111,28 +546,46 @@ void ParanoiaPool::gc_one_alloc() {
         << endl;
 #endif
 
-    // We should probably restore normal access to the victim pages before
-    // calling free(...).
-    if (victim.prot != PROT_READ|PROT_WRITE) {
-        if (mprotect(victim.addr, victim.num_bytes, PROT_READ|PROT_WRITE)) {
-            const string e = std::strerror(errno);
-            ostringstream os;
-            os << "Failed call to mprotect: " << e;
-            throw std::runtime_error(os.str());
-        }
-    }
+    // The victim's pages were already released when it entered quarantine.
+    arena_return_range(shard, static_cast<char*>(victim.addr), victim.num_bytes);
 
-    free(victim.addr);
+    assert(reserved_bytes_.load() >= victim.num_bytes);
+    reserved_bytes_ -= victim.num_bytes;
+    --num_stale_allocs_;
 
-    assert(total_alloc_bytes_ >= victim.num_bytes);
-    total_alloc_bytes_ -= victim.num_bytes;
+    bump(stats_.num_evictions);
+    bump(stats_.num_evicted_bytes, victim.num_bytes);
 
-    stale_allocs_.pop();
+    shard.stale_allocs.pop_front();
 }
 
-void* ParanoiaPool::allocate(size_t num_bytes, int initial_prot) {
+void* ParanoiaPool::allocate(size_t num_bytes, int initial_prot, size_t num_prefix_bytes) {
     assert(num_bytes > 0);
 
+    ScopedLatency latency(stats_.allocate_latency);
+
+    // Capture the stack here, outside the lock; it's the caller's that matters.
+    CapturedStack alloc_stack;
+    const bool record_stack = fault_reporting_enabled_.load(std::memory_order_relaxed);
+    if (record_stack) {
+        capture_stack(alloc_stack);
+    }
+
+    try {
+        return do_allocate(num_bytes, initial_prot, num_prefix_bytes, record_stack ? &alloc_stack : nullptr);
+    }
+    catch (...) {
+        bump(stats_.num_alloc_failures);
+        throw;
+    }
+}
+
+void* ParanoiaPool::do_allocate(
+        size_t num_bytes,
+        int initial_prot,
+        size_t num_prefix_bytes,
+        const CapturedStack* alloc_stack)
+{
 #if PARANOIA_LOGGING
     cout << __PRETTY_FUNCTION__ << " :"
         << " ENTER"
@@ -142,30 +595,45 @@ void* ParanoiaPool::allocate(size_t num_bytes, int initial_prot) {
 #endif
 
     const size_t new_alloc_num_pages = num_pages_needed(num_bytes);
-    const size_t new_alloc_total_bytes = new_alloc_num_pages * PAGE_SIZE;
 
-    gc_as_needed(new_alloc_total_bytes);
+    bool huge_pages;
+    const size_t new_alloc_total_bytes = buffer_num_bytes(new_alloc_num_pages * PAGE_SIZE, huge_pages);
 
-    void* p = aligned_alloc(PAGE_SIZE, new_alloc_total_bytes);
-    if (!p) {
-        const string e = std::strerror(errno);
-        ostringstream os;
-        os << ": "
-            << " PAGE_SIZE=" << PAGE_SIZE
-            << " new_alloc_total_bytes=" << new_alloc_total_bytes;
-        throw std::runtime_error(os.str());
-    }
+    const size_t shard_index = home_shard_index();
+    Shard & shard = shards_[shard_index];
+
+    gc_as_needed(new_alloc_total_bytes, 1, shard_index);
 
-    const auto iter = live_allocs_.find(p);
-    assert(iter == live_allocs_.end());
+    ShardLock lock(shard);
 
-    live_allocs_[p] = AllocDetails(p, new_alloc_total_bytes, initial_prot);
+    void* p = huge_pages ?
+        arena_take_huge_page_range(shard, new_alloc_total_bytes) :
+        arena_take_range(shard, new_alloc_total_bytes);
 
-    if (initial_prot != (PROT_READ | PROT_WRITE)) {
-        set_prot(p, initial_prot);
+    assert(! shard.live_allocs.find(p));
+
+    // Arena pages start out PROT_NONE, so the only mprotect needed is the
+    // one that opens the prefix.
+    AllocDetails & details = shard.live_allocs.insert(p, AllocDetails(p, new_alloc_total_bytes, PROT_NONE));
+    details.huge_pages = huge_pages;
+    if (alloc_stack) {
+        details.alloc_stack_seq = store_stack_locked(shard, *alloc_stack);
     }
 
-    total_alloc_bytes_ += new_alloc_total_bytes;
+    ++num_live_allocs_;
+    resident_bytes_ += new_alloc_total_bytes;
+    reserved_bytes_ += new_alloc_total_bytes;
+
+    if (huge_pages) {
+        ++num_huge_page_allocs_;
+        huge_page_alloc_bytes_ += new_alloc_total_bytes;
+    }
+
+    if ((initial_prot != PROT_NONE) && (num_prefix_bytes > 0)) {
+        ProtPlan plan;
+        plan.set_prot_prefix(p, std::min(num_prefix_bytes, new_alloc_total_bytes), initial_prot);
+        apply_locked(shard, plan);
+    }
 
 #if PARANOIA_LOGGING
     cout << __PRETTY_FUNCTION__ << " :"
@@ -184,29 +652,189 @@ void ParanoiaPool::deallocate(void* p) {
         << endl;
 #endif
 
-    const auto iter = live_allocs_.find(p);
-    if (iter == live_allocs_.end()) {
-        assert(! "pointer is not managed by this ParanoiaPool");
-        abort();
+    ScopedLatency latency(stats_.deallocate_latency);
+
+    // Rather than just making the buffer PROT_NONE, apply(...) drops its
+    // physical pages too.  Only the poisoned address range stays in quarantine.
+    ProtPlan plan;
+    plan.deallocate(p);
+    apply(plan);
+}
+
+static void mprotect_or_throw(void* addr, size_t num_bytes, int prot)
+{
+    if (num_bytes == 0) {
+        return;
+    }
+
+    if (mprotect(addr, num_bytes, prot)) {
+        const string e = std::strerror(errno);
+        ostringstream os;
+        os << "Failed call to mprotect: " << e;
+        throw std::runtime_error(os.str());
+    }
+}
+
+void* ParanoiaPool::grow_by_remap(void* p, size_t num_bytes, size_t num_prefix_bytes) {
+#if PARANOIA_LOGGING
+    cout << __PRETTY_FUNCTION__ << " :"
+        << " this=" << HexPtr(this)
+        << " p=" << HexPtr(p)
+        << " num_bytes=" << num_bytes
+        << endl;
+#endif
+
+    ScopedLatency latency(stats_.allocate_latency);
+
+    // The same stack serves as the new range's allocation and the old one's
+    // free.
+    CapturedStack stack;
+    const bool record_stack = fault_reporting_enabled_.load(std::memory_order_relaxed);
+    if (record_stack) {
+        capture_stack(stack);
+    }
+
+    // The new range comes from the same shard as the old one, so that we
+    // only need the one mutex.
+    Shard & shard = owning_shard(p);
+    const size_t shard_index = size_t(&shard - shards_.get());
+
+    bool huge_pages;
+    const size_t new_num_bytes = buffer_num_bytes(num_pages_needed(num_bytes) * PAGE_SIZE, huge_pages);
+
+    gc_as_needed(new_num_bytes, 1, shard_index);
+
+    char* new_addr;
+
+    {
+        ShardLock lock(shard);
+
+        const AllocDetails* const p_details = shard.live_allocs.find(p);
+        if (! p_details) {
+            assert(! "pointer not managed by this ParanoiaPool.");
+            abort();
+        }
+
+        AllocDetails old_details = *p_details;
+        assert(new_num_bytes >= old_details.num_bytes);
+
+        char* const old_addr = static_cast<char*>(p);
+        const int prot = old_details.prot;
+        const size_t old_open_bytes = (prot == PROT_NONE) ? 0 : old_details.num_prefix_bytes;
+        const size_t new_open_bytes = (prot == PROT_NONE) ? 0 :
+            std::max(old_open_bytes, num_pages_needed(std::min(num_prefix_bytes, new_num_bytes)) * PAGE_SIZE);
+
+        new_addr = huge_pages ?
+            arena_take_huge_page_range(shard, new_num_bytes) :
+            arena_take_range(shard, new_num_bytes);
+
+        try {
+            // Open the added pages first: until the old pages have been moved,
+            // a failure leaves 'p' as it was.
+            if (new_open_bytes > old_open_bytes) {
+                bump(stats_.num_mprotect_calls);
+                mprotect_or_throw(new_addr + old_open_bytes, new_open_bytes - old_open_bytes, prot);
+            }
+
+            // Only the accessible prefix holds anything worth keeping, and having
+            // one protection, it's one VMA, as mremap requires.  MREMAP_DONTUNMAP
+            // leaves the old range mapped, so there's never a hole in our
+            // reservation for someone else's mmap to land in.
+            if (old_open_bytes > 0) {
+                bump(stats_.num_mremap_calls);
+                void* const q = mremap(old_addr, old_open_bytes, old_open_bytes,
+                        MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, new_addr);
+
+                if (q == MAP_FAILED) {
+                    // EINVAL means a kernel older than 5.7, without
+                    // MREMAP_DONTUNMAP; copy instead, if we can read the old
+                    // pages.  Anything else (e.g. ENOMEM, out of VMAs) would
+                    // fail a copy too.
+                    const int remap_errno = errno;
+                    if ((remap_errno != EINVAL) || (! (prot & PROT_READ))) {
+                        const string e = std::strerror(remap_errno);
+                        ostringstream os;
+                        os << "Failed call to mremap: " << e;
+                        throw std::runtime_error(os.str());
+                    }
+
+                    bump(stats_.num_mprotect_calls);
+                    mprotect_or_throw(new_addr, old_open_bytes, PROT_READ | PROT_WRITE);
+                    paranoia_bulk_copy(new_addr, old_addr, old_open_bytes);
+
+                    if (prot != (PROT_READ | PROT_WRITE)) {
+                        bump(stats_.num_mprotect_calls);
+                        mprotect_or_throw(new_addr, old_open_bytes, prot);
+                    }
+                }
+            }
+        }
+        catch (...) {
+            // 'p' is untouched.  Give the new range back as fresh PROT_NONE
+            // pages, as the arena expects.
+            arena_release_pages(new_addr, new_num_bytes);
+            arena_return_range(shard, new_addr, new_num_bytes);
+            throw;
+        }
+
+        // The old range is quarantined just like a deallocated buffer.
+        arena_release_pages(old_addr, old_details.num_bytes);
+
+        AllocDetails new_details(new_addr, new_num_bytes, prot);
+        new_details.num_prefix_bytes = (prot == PROT_NONE) ? new_num_bytes : new_open_bytes;
+        new_details.huge_pages = huge_pages;
+        old_details.prot = PROT_NONE;
+
+        collapse_completed_huge_page(new_details, old_open_bytes, new_open_bytes);
+
+        if (record_stack) {
+            const uint64_t seq = store_stack_locked(shard, stack);
+            new_details.alloc_stack_seq = seq;
+            old_details.free_stack_seq = seq;
+        }
+
+        shard.live_allocs.erase(p);
+        shard.live_allocs.insert(new_addr, new_details);
+        shard.stale_allocs.push_back(old_details);
+
+        assert(resident_bytes_.load() >= old_details.num_bytes);
+        resident_bytes_ += new_num_bytes - old_details.num_bytes;
+        reserved_bytes_ += new_num_bytes;
+        ++num_stale_allocs_;
+
+        if (old_details.huge_pages) {
+            --num_huge_page_allocs_;
+            huge_page_alloc_bytes_ -= old_details.num_bytes;
+        }
+
+        if (huge_pages) {
+            ++num_huge_page_allocs_;
+            huge_page_alloc_bytes_ += new_num_bytes;
+        }
     }
 
-    set_prot(p, PROT_NONE);
+    gc_as_needed(0, 0, shard_index);
 
-    stale_allocs_.push(iter->second);
-    live_allocs_.erase(iter);
+#if PARANOIA_LOGGING
+    cout << __PRETTY_FUNCTION__ << " :"
+        << " RETURN=" << HexPtr(new_addr)
+        << endl;
+#endif
 
-    // Just in case we were already over preferred capacity.
-    gc_as_needed(0);
+    return new_addr;
 }
 
 int ParanoiaPool::get_prot(void* p) {
-    const auto iter = live_allocs_.find(p);
-    if (iter == live_allocs_.end()) {
+    Shard & shard = owning_shard(p);
+    ShardLock lock(shard);
+
+    AllocDetails* const p_details = shard.live_allocs.find(p);
+    if (! p_details) {
         assert(! "pointer not managed by this ParanoiaPool.");
         abort();
     }
 
-    return iter->second.prot;
+    return p_details->prot;
 }
 
 void ParanoiaPool::set_prot(void* p, int prot) {
@@ -217,26 +845,273 @@ void ParanoiaPool::set_prot(void* p, int prot) {
         << endl;
 #endif
 
-    const auto iter = live_allocs_.find(p);
-    if (iter == live_allocs_.end()) {
-        assert(! "pointer not managed by this ParanoiaPool.");
+    ScopedLatency latency(stats_.set_prot_latency);
+
+    ProtPlan plan;
+    plan.set_prot(p, prot);
+    apply(plan);
+}
+
+size_t ParanoiaPool::set_prot_prefix(void* p, size_t num_bytes, int prot) {
+#if PARANOIA_LOGGING
+    cout << __PRETTY_FUNCTION__ << " :"
+        << " this=" << HexPtr(this)
+        << " p=" << HexPtr(p)
+        << " num_bytes=" << num_bytes
+        << endl;
+#endif
+
+    ScopedLatency latency(stats_.set_prot_latency);
+
+    ProtPlan plan;
+    plan.set_prot_prefix(p, num_bytes, prot);
+    apply(plan);
+
+    return (prot == PROT_NONE) ? 0 : num_pages_needed(num_bytes) * PAGE_SIZE;
+}
+
+void ParanoiaPool::ProtPlan::add_step(const Step & step) {
+    if (num_steps_ == MAX_STEPS) {
+        assert(! "Too many steps in one ParanoiaPool::ProtPlan.");
         abort();
     }
 
-    if (iter->second.prot == prot) {
-        return;
+    steps_[num_steps_++] = step;
+}
+
+void ParanoiaPool::ProtPlan::set_prot(void* p, int prot) {
+    add_step(Step{p, SIZE_MAX, prot, false});
+}
+
+void ParanoiaPool::ProtPlan::set_prot_prefix(void* p, size_t num_bytes, int prot) {
+    add_step(Step{p, num_bytes, prot, false});
+}
+
+void ParanoiaPool::ProtPlan::deallocate(void* p) {
+    add_step(Step{p, 0, PROT_NONE, true});
+}
+
+void ParanoiaPool::add_prefix_change_ops(
+        const AllocDetails & details,
+        size_t new_prefix_bytes,
+        int prot,
+        PageOp* ops,
+        size_t & num_ops)
+{
+    // A PROT_NONE prefix is indistinguishable from an empty one, so compare
+    // the ranges that are actually accessible before and after.
+    const size_t old_open_bytes = (details.prot == PROT_NONE) ? 0 : details.num_prefix_bytes;
+    const size_t new_open_bytes = (prot == PROT_NONE) ? 0 : new_prefix_bytes;
+
+    char* const base = static_cast<char*>(details.addr);
+
+    if (prot == details.prot) {
+        if (new_open_bytes > old_open_bytes) {
+            ops[num_ops++] = PageOp{base + old_open_bytes, new_open_bytes - old_open_bytes, prot, false};
+        }
+    }
+    else if (new_open_bytes > 0) {
+        ops[num_ops++] = PageOp{base, new_open_bytes, prot, false};
     }
 
-    const size_t num_bytes = iter->second.num_bytes;
+    if (old_open_bytes > new_open_bytes) {
+        ops[num_ops++] = PageOp{base + new_open_bytes, old_open_bytes - new_open_bytes, PROT_NONE, false};
+    }
+}
 
-    if (mprotect(p, num_bytes, prot)) {
-        const string e = std::strerror(errno);
-        ostringstream os;
-        os << "Failed call to mprotect: " << e;
-        throw std::runtime_error(os.str());
+void ParanoiaPool::issue_page_ops(PageOp* ops, size_t num_ops) {
+    // Sort by address (there are only a handful), then merge neighbours that
+    // want the same treatment.
+    for (size_t i = 1; i < num_ops; ++i) {
+        for (size_t j = i; (j > 0) && (ops[j].addr < ops[j-1].addr); --j) {
+            std::swap(ops[j], ops[j-1]);
+        }
+    }
+
+    size_t num_merged = 0;
+    for (size_t i = 0; i < num_ops; ++i) {
+        if (num_merged > 0) {
+            PageOp & prev = ops[num_merged - 1];
+            if ((prev.addr + prev.num_bytes == ops[i].addr) &&
+                    (prev.release == ops[i].release) &&
+                    (prev.prot == ops[i].prot))
+            {
+                prev.num_bytes += ops[i].num_bytes;
+                continue;
+            }
+        }
+
+        ops[num_merged++] = ops[i];
+    }
+
+    for (size_t i = 0; i < num_merged; ++i) {
+        if (ops[i].release) {
+            arena_release_pages(ops[i].addr, ops[i].num_bytes);
+        }
+        else if (ops[i].num_bytes > 0) {
+            bump(stats_.num_mprotect_calls);
+            mprotect_or_throw(ops[i].addr, ops[i].num_bytes, ops[i].prot);
+        }
+    }
+}
+
+void ParanoiaPool::apply(const ProtPlan & plan) {
+    CapturedStack free_stack;
+    bool record_stack = false;
+    bool deallocates = false;
+
+    for (size_t i = 0; i < plan.num_steps_; ++i) {
+        deallocates = deallocates || plan.steps_[i].deallocate;
+    }
+
+    if (deallocates && fault_reporting_enabled_.load(std::memory_order_relaxed)) {
+        record_stack = true;
+        capture_stack(free_stack);
+    }
+
+    // Each shard's share of the plan is applied under just that shard's
+    // mutex.  Usually there's only the one.
+    Shard* step_shards[ProtPlan::MAX_STEPS];
+    for (size_t i = 0; i < plan.num_steps_; ++i) {
+        step_shards[i] = &owning_shard(plan.steps_[i].p);
+    }
+
+    for (size_t i = 0; i < plan.num_steps_; ++i) {
+        Shard* const shard = step_shards[i];
+        if (! shard) {
+            continue;
+        }
+
+        ProtPlan shard_plan;
+        for (size_t j = i; j < plan.num_steps_; ++j) {
+            if (step_shards[j] == shard) {
+                shard_plan.add_step(plan.steps_[j]);
+                step_shards[j] = nullptr;
+            }
+        }
+
+        ShardLock lock(*shard);
+        apply_locked(*shard, shard_plan, record_stack ? &free_stack : nullptr);
+    }
+
+    if (deallocates) {
+        // Just in case we were already over preferred capacity.
+        gc_as_needed(0, 0, home_shard_index());
+    }
+}
+
+void ParanoiaPool::apply_locked(Shard & shard, const ProtPlan & plan, const CapturedStack* free_stack) {
+    // The final state of each buffer touched by the plan.
+    struct Target {
+        AllocDetails* details;
+        size_t prefix_bytes;
+        int prot;
+        bool deallocate;
+    };
+
+    Target targets[ProtPlan::MAX_STEPS];
+    size_t num_targets = 0;
+
+    for (size_t i = 0; i < plan.num_steps_; ++i) {
+        const ProtPlan::Step & step = plan.steps_[i];
+
+        Target* t = nullptr;
+        for (size_t j = 0; j < num_targets; ++j) {
+            if (targets[j].details->addr == step.p) {
+                t = &(targets[j]);
+                break;
+            }
+        }
+
+        if (! t) {
+            AllocDetails* const p_details = shard.live_allocs.find(step.p);
+            if (! p_details) {
+                assert(! "pointer not managed by this ParanoiaPool.");
+                abort();
+            }
+
+            t = &(targets[num_targets++]);
+            *t = Target{p_details, p_details->num_prefix_bytes, p_details->prot, false};
+        }
+
+        if (t->deallocate) {
+            continue;
+        }
+        else if (step.deallocate) {
+            t->deallocate = true;
+        }
+        else {
+            const size_t num_bytes = (step.num_bytes == SIZE_MAX) ? t->details->num_bytes : step.num_bytes;
+            assert(num_bytes <= t->details->num_bytes);
+
+            t->prefix_bytes = num_pages_needed(num_bytes) * PAGE_SIZE;
+            t->prot = step.prot;
+        }
+    }
+
+    PageOp ops[2 * ProtPlan::MAX_STEPS];
+    size_t num_ops = 0;
+
+    for (size_t i = 0; i < num_targets; ++i) {
+        const Target & t = targets[i];
+        if (t.deallocate) {
+            ops[num_ops++] = PageOp{static_cast<char*>(t.details->addr), t.details->num_bytes, PROT_NONE, true};
+        }
+        else {
+            add_prefix_change_ops(*(t.details), t.prefix_bytes, t.prot, ops, num_ops);
+        }
+    }
+
+    issue_page_ops(ops, num_ops);
+
+    // Erasing from live_allocs can move its entries (and so invalidate the
+    // 'details' pointers), so finish with every target before erasing any.
+    void* deallocated[ProtPlan::MAX_STEPS];
+    size_t num_deallocated = 0;
+
+    // All the buffers freed by one plan share a stack record.
+    uint64_t free_stack_seq = 0;
+
+    for (size_t i = 0; i < num_targets; ++i) {
+        Target & t = targets[i];
+        if (t.deallocate) {
+            AllocDetails details = *(t.details);
+            details.prot = PROT_NONE;
+
+            if (free_stack) {
+                if (free_stack_seq == 0) {
+                    free_stack_seq = store_stack_locked(shard, *free_stack);
+                }
+                details.free_stack_seq = free_stack_seq;
+            }
+
+            assert(resident_bytes_.load() >= details.num_bytes);
+            resident_bytes_ -= details.num_bytes;
+            --num_live_allocs_;
+            ++num_stale_allocs_;
+
+            if (details.huge_pages) {
+                --num_huge_page_allocs_;
+                huge_page_alloc_bytes_ -= details.num_bytes;
+            }
+
+            shard.stale_allocs.push_back(details);
+            deallocated[num_deallocated++] = details.addr;
+        }
+        else {
+            const size_t old_open_bytes = (t.details->prot == PROT_NONE) ? 0 : t.details->num_prefix_bytes;
+            const size_t new_open_bytes = (t.prot == PROT_NONE) ? 0 : t.prefix_bytes;
+
+            t.details->prot = t.prot;
+            t.details->num_prefix_bytes = t.prefix_bytes;
+
+            collapse_completed_huge_page(*(t.details), old_open_bytes, new_open_bytes);
+        }
     }
 
-    iter->second.prot = prot;
+    for (size_t i = 0; i < num_deallocated; ++i) {
+        shard.live_allocs.erase(deallocated[i]);
+    }
 }
 
 size_t ParanoiaPool::num_pages_needed(size_t num_bytes) {
@@ -248,3 +1123,245 @@ size_t ParanoiaPool::num_pages_needed(size_t num_bytes) {
         return full_pages;
     }
 }
+
+bool ParanoiaPool::owns(const void* p) const {
+    return find_shard(p) != nullptr;
+}
+
+void ParanoiaPool::arena_reserve_region(Shard & shard, size_t min_num_bytes) {
+    assert(min_num_bytes % PAGE_SIZE == 0);
+
+    // If the kernel won't give us a full region (e.g. because of RLIMIT_AS),
+    // settle for less.
+    size_t num_bytes = std::max(min_num_bytes, ARENA_REGION_BYTES);
+    void* p;
+
+    while (true) {
+        bump(stats_.num_mmap_calls);
+        p = mmap(nullptr, num_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if ((p != MAP_FAILED) || (num_bytes == min_num_bytes)) {
+            break;
+        }
+
+        num_bytes = std::max(min_num_bytes, num_bytes / 2);
+    }
+
+    if (p == MAP_FAILED) {
+        const string e = std::strerror(errno);
+        ostringstream os;
+        os << "Failed call to mmap: " << e
+            << " num_bytes=" << num_bytes;
+        throw std::runtime_error(os.str());
+    }
+
+#if PARANOIA_LOGGING
+    cout << __PRETTY_FUNCTION__ << " :"
+        << " this=" << HexPtr(this)
+        << " base=" << HexPtr(p)
+        << " num_bytes=" << num_bytes
+        << endl;
+#endif
+
+    {
+        std::lock_guard<std::mutex> lock(region_dir_mutex_);
+
+        const size_t num_entries = num_region_dir_entries_.load(std::memory_order_relaxed);
+        if (num_entries == MAX_ARENA_REGIONS) {
+            bump(stats_.num_munmap_calls);
+            munmap(p, num_bytes);
+            throw std::runtime_error("ParanoiaPool has reserved too many arena regions.");
+        }
+
+        char* const base = static_cast<char*>(p);
+        size_t pos = num_entries;
+        while ((pos > 0) && (region_dir_[pos - 1].base.load(std::memory_order_relaxed) > base)) {
+            --pos;
+        }
+
+        const uint64_t seq = region_dir_seq_.load(std::memory_order_relaxed);
+        region_dir_seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = num_entries; i > pos; --i) {
+            RegionDirEntry & to = region_dir_[i];
+            const RegionDirEntry & from = region_dir_[i - 1];
+            to.base.store(from.base.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            to.num_bytes.store(from.num_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            to.shard.store(from.shard.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        region_dir_[pos].base.store(base, std::memory_order_relaxed);
+        region_dir_[pos].num_bytes.store(num_bytes, std::memory_order_relaxed);
+        region_dir_[pos].shard.store(&shard, std::memory_order_relaxed);
+        num_region_dir_entries_.store(num_entries + 1, std::memory_order_relaxed);
+
+        region_dir_seq_.store(seq + 2, std::memory_order_release);
+    }
+
+    // Don't strand whatever is left at the end of the current region.
+    if (! shard.arena_regions.empty()) {
+        ArenaRegion & r = shard.arena_regions.back();
+        if (r.num_bytes_used < r.num_bytes) {
+            arena_store_free_range(shard, r.base + r.num_bytes_used, r.num_bytes - r.num_bytes_used);
+            r.num_bytes_used = r.num_bytes;
+        }
+    }
+
+    shard.arena_regions.push_back(ArenaRegion{static_cast<char*>(p), num_bytes, 0});
+}
+
+char* ParanoiaPool::arena_take_range(Shard & shard, size_t num_bytes) {
+    assert(num_bytes % PAGE_SIZE == 0);
+
+    // An exact size-class match among the recycled ranges...
+    const size_t num_pages = num_bytes / PAGE_SIZE;
+    if (num_pages <= MAX_SIZE_CLASS_PAGES) {
+        std::vector<char*> & size_class = shard.size_class_free_ranges[num_pages];
+        if (! size_class.empty()) {
+            char* const p = size_class.back();
+            size_class.pop_back();
+            return p;
+        }
+    }
+    else {
+        // ... or a best fit among the large ones ...
+        const auto iter = shard.large_free_ranges.lower_bound(num_bytes);
+        if (iter != shard.large_free_ranges.end()) {
+            char* const p = iter->second;
+            const size_t range_num_bytes = iter->first;
+            shard.large_free_ranges.erase(iter);
+            shard.large_free_ranges_by_addr.erase(p);
+
+            if (range_num_bytes > num_bytes) {
+                arena_store_free_range(shard, p + num_bytes, range_num_bytes - num_bytes);
+            }
+
+            return p;
+        }
+    }
+
+    // ... otherwise carve it from never-used address space.
+    if (shard.arena_regions.empty() ||
+            (shard.arena_regions.back().num_bytes - shard.arena_regions.back().num_bytes_used < num_bytes))
+    {
+        arena_reserve_region(shard, num_bytes);
+    }
+
+    ArenaRegion & r = shard.arena_regions.back();
+    char* const p = r.base + r.num_bytes_used;
+    r.num_bytes_used += num_bytes;
+    return p;
+}
+
+char* ParanoiaPool::arena_take_huge_page_range(Shard & shard, size_t num_bytes) {
+    assert(num_bytes % HUGE_PAGE_SIZE == 0);
+
+    // Take enough to be sure of an aligned range, and give back the rest.
+    const size_t slack_bytes = HUGE_PAGE_SIZE - PAGE_SIZE;
+    char* const p = arena_take_range(shard, num_bytes + slack_bytes);
+
+    const uintptr_t misalignment = reinterpret_cast<uintptr_t>(p) % HUGE_PAGE_SIZE;
+    const size_t head_bytes = (misalignment == 0) ? 0 : (HUGE_PAGE_SIZE - misalignment);
+    char* const aligned = p + head_bytes;
+
+    if (head_bytes > 0) {
+        arena_store_free_range(shard, p, head_bytes);
+    }
+
+    if (slack_bytes > head_bytes) {
+        arena_store_free_range(shard, aligned + num_bytes, slack_bytes - head_bytes);
+    }
+
+    // Arena ranges are remapped fresh when quarantined, which clears this
+    // advice again.  It's only a hint, so ignore failures (e.g. a kernel
+    // without THP).
+    madvise(aligned, num_bytes, MADV_HUGEPAGE);
+
+    return aligned;
+}
+
+void ParanoiaPool::arena_release_pages(char* p, size_t num_bytes) {
+    // Mapping fresh PROT_NONE pages over the range releases its physical
+    // memory and makes it inaccessible, in a single syscall.
+    bump(stats_.num_mmap_calls);
+    void* const q = mmap(p, num_bytes, PROT_NONE,
+            MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (q == MAP_FAILED) {
+        const string e = std::strerror(errno);
+        ostringstream os;
+        os << "Failed call to mmap: " << e;
+        throw std::runtime_error(os.str());
+    }
+}
+
+void ParanoiaPool::arena_return_range(Shard & shard, char* p, size_t num_bytes) {
+    if (num_bytes / PAGE_SIZE > MAX_SIZE_CLASS_PAGES) {
+        // That may extend it up to the never-used part of the region.
+        arena_merge_large_neighbours(shard, p, num_bytes);
+    }
+
+    ArenaRegion & r = shard.arena_regions.back();
+    if (p + num_bytes == r.base + r.num_bytes_used) {
+        r.num_bytes_used -= num_bytes;
+        return;
+    }
+
+    arena_store_free_range(shard, p, num_bytes);
+}
+
+void ParanoiaPool::arena_store_free_range(Shard & shard, char* p, size_t num_bytes) {
+    assert(num_bytes % PAGE_SIZE == 0);
+
+    const size_t num_pages = num_bytes / PAGE_SIZE;
+    if (num_pages <= MAX_SIZE_CLASS_PAGES) {
+        shard.size_class_free_ranges[num_pages].push_back(p);
+    }
+    else {
+        arena_merge_large_neighbours(shard, p, num_bytes);
+        shard.large_free_ranges.emplace(num_bytes, p);
+        shard.large_free_ranges_by_addr.emplace(p, num_bytes);
+    }
+}
+
+void ParanoiaPool::arena_erase_large_free_range(Shard & shard, std::map<char*,size_t>::iterator by_addr_iter) {
+    const auto range = shard.large_free_ranges.equal_range(by_addr_iter->second);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second == by_addr_iter->first) {
+            shard.large_free_ranges.erase(iter);
+            break;
+        }
+    }
+
+    shard.large_free_ranges_by_addr.erase(by_addr_iter);
+}
+
+void ParanoiaPool::arena_merge_large_neighbours(Shard & shard, char* & p, size_t & num_bytes) {
+    auto & by_addr = shard.large_free_ranges_by_addr;
+
+    // Separately reserved regions may happen to be adjacent, but a range
+    // mustn't span two of them.
+    const auto next = by_addr.find(p + num_bytes);
+    if ((next != by_addr.end()) && (! is_arena_region_base(shard, next->first))) {
+        num_bytes += next->second;
+        arena_erase_large_free_range(shard, next);
+    }
+
+    auto prev = by_addr.lower_bound(p);
+    if ((prev != by_addr.begin()) && (! is_arena_region_base(shard, p))) {
+        --prev;
+        if (prev->first + prev->second == p) {
+            p = prev->first;
+            num_bytes += prev->second;
+            arena_erase_large_free_range(shard, prev);
+        }
+    }
+}
+
+bool ParanoiaPool::is_arena_region_base(const Shard & shard, const char* p) {
+    for (const ArenaRegion & r : shard.arena_regions) {
+        if (r.base == p) {
+            return true;
+        }
+    }
+    return false;
+}
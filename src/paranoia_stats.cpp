@@ -0,0 +1,47 @@
+#include "paranoia_stats.h"
+
+#include <cmath>
+
+using namespace std;
+
+uint64_t ParanoiaLatencyHistogram::total_count() const
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        total += counts[i];
+    }
+    return total;
+}
+
+uint64_t ParanoiaLatencyHistogram::quantile_upper_bound_ns(double q) const
+{
+    const uint64_t total = total_count();
+    if (total == 0) {
+        return 0;
+    }
+
+    // The rank of the sample we're after, counting from 1.
+    uint64_t rank = uint64_t(std::ceil(q * double(total)));
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return (uint64_t(1) << (i + 1)) - 1;
+        }
+    }
+
+    return (uint64_t(1) << NUM_BUCKETS) - 1;
+}
+
+ParanoiaLatencyHistogram ParanoiaAtomicLatencyHistogram::snapshot() const
+{
+    ParanoiaLatencyHistogram h;
+    for (size_t i = 0; i < ParanoiaLatencyHistogram::NUM_BUCKETS; ++i) {
+        h.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    return h;
+}
@@ -7,6 +7,10 @@
 #include <memory>
 #include <unistd.h>
 
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+
 using namespace std;
 
 ParanoiaPool_real::AllocDetails::AllocDetails(
@@ -23,9 +27,22 @@ void ParanoiaPool_real::set_preferred_max_bytes(size_t num_bytes)
     gc_as_needed(0);
 }
 
+size_t ParanoiaPool_real::budgeted_total_bytes() const
+{
+    if (shared_total_bytes_) {
+        return shared_total_bytes_->load(std::memory_order_relaxed);
+    }
+    else {
+        return total_alloc_bytes_;
+    }
+}
+
 void ParanoiaPool_real::gc_as_needed(size_t upcoming_alloc_bytes)
 {
-    while ((total_alloc_bytes_ + upcoming_alloc_bytes > preferred_max_bytes_) &&
+    // When the budget is shared, we can only evict our own quarantined
+    // allocations.  Whoever shares the budget has to ask the other pools to
+    // do their part.
+    while ((budgeted_total_bytes() + upcoming_alloc_bytes > preferred_max_bytes_) &&
             (! stale_allocs_.empty()))
     {
         gc_one_alloc();
@@ -46,9 +63,80 @@ size_t ParanoiaPool_real::get_page_size()
 }
 
 ParanoiaPool_real::ParanoiaPool_real(
-        size_t preferred_max_bytes) :
-    preferred_max_bytes_(preferred_max_bytes)
+        size_t preferred_max_bytes,
+        void* region,
+        size_t region_num_bytes,
+        std::atomic<size_t>* shared_total_bytes) :
+    preferred_max_bytes_(preferred_max_bytes),
+    region_(static_cast<char*>(region)),
+    region_num_bytes_(region_num_bytes),
+    shared_total_bytes_(shared_total_bytes)
+{
+    assert(region_);
+    assert(region_num_bytes_ % s_page_size_ == 0);
+}
+
+bool ParanoiaPool_real::owns(const void* p) const
+{
+    const char* const cp = static_cast<const char*>(p);
+    return (cp >= region_) && (cp < region_ + region_num_bytes_);
+}
+
+char* ParanoiaPool_real::take_range(size_t num_bytes)
+{
+    const size_t num_pages = num_bytes / s_page_size_;
+    if (num_pages <= MAX_SIZE_CLASS_PAGES) {
+        auto & size_class = size_class_free_ranges_[num_pages];
+        if (! size_class.empty()) {
+            char* const p = size_class.back();
+            size_class.pop_back();
+            return p;
+        }
+    }
+    else {
+        const auto iter = large_free_ranges_.lower_bound(num_bytes);
+        if (iter != large_free_ranges_.end()) {
+            char* const p = iter->second;
+            const size_t range_num_bytes = iter->first;
+            large_free_ranges_.erase(iter);
+
+            if (range_num_bytes > num_bytes) {
+                store_free_range(p + num_bytes, range_num_bytes - num_bytes);
+            }
+
+            return p;
+        }
+    }
+
+    if (region_num_bytes_ - region_num_bytes_used_ < num_bytes) {
+        return nullptr;
+    }
+
+    char* const p = region_ + region_num_bytes_used_;
+    region_num_bytes_used_ += num_bytes;
+    return p;
+}
+
+void ParanoiaPool_real::store_free_range(char* p, size_t num_bytes)
 {
+    const size_t num_pages = num_bytes / s_page_size_;
+    if (num_pages <= MAX_SIZE_CLASS_PAGES) {
+        size_class_free_ranges_[num_pages].push_back(p);
+    }
+    else {
+        large_free_ranges_.emplace(num_bytes, p);
+    }
+}
+
+void ParanoiaPool_real::release_pages(char* p, size_t num_bytes)
+{
+    // Drops the physical pages and makes the range PROT_NONE, in one syscall.
+    void* const q = mmap(p, num_bytes, PROT_NONE,
+            MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (q == MAP_FAILED) {
+        assert(!"Failed call to mmap.");
+        abort();
+    }
 }
 
 ParanoiaPool_real::~ParanoiaPool_real() {
@@ -66,18 +154,21 @@ void ParanoiaPool_real::gc_one_alloc() {
 
     AllocDetails & victim = stale_allocs_.front();
 
-    // We should probably restore normal access to the victim pages before
-    // calling free(...).
-    if (victim.prot != PROT_READ|PROT_WRITE) {
-        if (mprotect(victim.addr, victim.num_bytes, PROT_READ|PROT_WRITE)) {
-            assert(!"Failed call to mprotect.");
-        }
+    // The victim's pages were released when it entered quarantine, so it can
+    // go straight back into circulation.
+    char* const addr = static_cast<char*>(victim.addr);
+    if (addr + victim.num_bytes == region_ + region_num_bytes_used_) {
+        region_num_bytes_used_ -= victim.num_bytes;
+    }
+    else {
+        store_free_range(addr, victim.num_bytes);
     }
-
-    real_free(victim.addr);
 
     assert(total_alloc_bytes_ >= victim.num_bytes);
     total_alloc_bytes_ -= victim.num_bytes;
+    if (shared_total_bytes_) {
+        shared_total_bytes_->fetch_sub(victim.num_bytes, std::memory_order_relaxed);
+    }
 
     stale_allocs_.pop();
 }
@@ -90,22 +181,27 @@ void* ParanoiaPool_real::allocate(size_t num_bytes, int initial_prot) {
 
     gc_as_needed(new_alloc_total_bytes);
 
-    void* p = aligned_alloc(s_page_size_, new_alloc_total_bytes);
+    void* p = take_range(new_alloc_total_bytes);
     if (!p) {
-        assert(!"aligned_alloc failed.");
+        // Our address range is exhausted.
         return nullptr;
     }
 
     const auto iter = live_allocs_.find(p);
     assert(iter == live_allocs_.end());
 
-    live_allocs_[p] = AllocDetails(p, new_alloc_total_bytes, initial_prot);
+    // Fresh ranges are PROT_NONE.
+    live_allocs_[p] = AllocDetails(p, new_alloc_total_bytes, PROT_NONE);
 
-    if (initial_prot != (PROT_READ | PROT_WRITE)) {
+    if (initial_prot != PROT_NONE) {
         set_prot(p, initial_prot);
     }
 
     total_alloc_bytes_ += new_alloc_total_bytes;
+    if (shared_total_bytes_) {
+        shared_total_bytes_->fetch_add(new_alloc_total_bytes, std::memory_order_relaxed);
+    }
+
     return p;
 }
 
@@ -123,7 +219,10 @@ void ParanoiaPool_real::deallocate(void* p) {
         abort();
     }
 
-    set_prot(p, PROT_NONE);
+    // Drop the physical pages too; only the poisoned address range needs to
+    // stay in quarantine.
+    release_pages(static_cast<char*>(p), iter->second.num_bytes);
+    iter->second.prot = PROT_NONE;
 
     stale_allocs_.push(iter->second);
     live_allocs_.erase(iter);
@@ -132,6 +231,106 @@ void ParanoiaPool_real::deallocate(void* p) {
     gc_as_needed(0);
 }
 
+void* ParanoiaPool_real::reallocate(void* p, size_t num_bytes) {
+    assert(num_bytes > 0);
+
+    const auto iter = live_allocs_.find(p);
+    if (iter == live_allocs_.end()) {
+        assert(! "pointer not managed by this ParanoiaPool_real.");
+        abort();
+    }
+
+    char* const old_addr = static_cast<char*>(p);
+    const size_t old_num_bytes = iter->second.num_bytes;
+    const int prot = iter->second.prot;
+    const size_t new_num_bytes = num_pages_needed(num_bytes) * s_page_size_;
+
+    if (new_num_bytes == old_num_bytes) {
+        return p;
+    }
+
+    if (new_num_bytes < old_num_bytes) {
+        // The tail is still counted against the budget until it's evicted,
+        // just like any other quarantined range.
+        char* const tail = old_addr + new_num_bytes;
+        const size_t tail_num_bytes = old_num_bytes - new_num_bytes;
+
+        release_pages(tail, tail_num_bytes);
+        stale_allocs_.push(AllocDetails(tail, tail_num_bytes, PROT_NONE));
+        iter->second.num_bytes = new_num_bytes;
+
+        gc_as_needed(0);
+        return p;
+    }
+
+    gc_as_needed(new_num_bytes);
+
+    char* const new_addr = take_range(new_num_bytes);
+    if (! new_addr) {
+        return nullptr;
+    }
+
+    // Move the existing pages rather than copying them.  MREMAP_DONTUNMAP
+    // leaves the old range mapped, so there's never a hole in our
+    // reservation for someone else's mmap to land in.
+    bool moved = false;
+    if ((old_num_bytes >= MREMAP_MIN_BYTES) || (prot != (PROT_READ | PROT_WRITE))) {
+        void* const q = mremap(old_addr, old_num_bytes, old_num_bytes,
+                MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, new_addr);
+        moved = (q != MAP_FAILED);
+    }
+
+    if (moved) {
+        if ((prot != PROT_NONE) &&
+                mprotect(new_addr + old_num_bytes, new_num_bytes - old_num_bytes, prot))
+        {
+            assert(!"Failed call to mprotect.");
+            abort();
+        }
+    }
+    else {
+        // We can only copy what we can read.
+        if (prot != (PROT_READ | PROT_WRITE)) {
+            assert(!"Failed call to mremap.");
+            abort();
+        }
+
+        // Fresh ranges are PROT_NONE, and already zero-filled.
+        if (mprotect(new_addr, new_num_bytes, prot)) {
+            assert(!"Failed call to mprotect.");
+            abort();
+        }
+
+        memcpy(new_addr, old_addr, old_num_bytes);
+    }
+
+    // The old range stays poisoned in quarantine, exactly as if it had been
+    // passed to 'deallocate'.
+    release_pages(old_addr, old_num_bytes);
+    stale_allocs_.push(AllocDetails(old_addr, old_num_bytes, PROT_NONE));
+    live_allocs_.erase(iter);
+
+    live_allocs_[new_addr] = AllocDetails(new_addr, new_num_bytes, prot);
+
+    total_alloc_bytes_ += new_num_bytes;
+    if (shared_total_bytes_) {
+        shared_total_bytes_->fetch_add(new_num_bytes, std::memory_order_relaxed);
+    }
+
+    gc_as_needed(0);
+    return new_addr;
+}
+
+size_t ParanoiaPool_real::usable_size(const void* p) const {
+    const auto iter = live_allocs_.find(const_cast<void*>(p));
+    if (iter == live_allocs_.end()) {
+        assert(! "pointer not managed by this ParanoiaPool_real.");
+        abort();
+    }
+
+    return iter->second.num_bytes;
+}
+
 int ParanoiaPool_real::get_prot(void* p) {
     const auto iter = live_allocs_.find(p);
     if (iter == live_allocs_.end()) {
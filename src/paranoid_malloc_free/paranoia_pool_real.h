@@ -1,8 +1,10 @@
 #pragma once
 
 #include <sys/mman.h>
+#include <atomic>
 #include <map>
 #include <queue>
+#include <vector>
 #include <memory>
 
 #include "real_allocator.h"
@@ -11,10 +13,23 @@
 // uses 'real_allocator' instead of the default allocator.
 // That makes this class suitable for use by code that provides alternative
 // implementations of the 'malloc' and 'free' functions.
+//
+// All buffers are carved out of a single caller-supplied PROT_NONE address
+// range, so ownership of a pointer can be decided with a range check.
 class ParanoiaPool_real {
     public:
+        // 'region' must be 'region_num_bytes' of page-aligned, PROT_NONE address
+        // space reserved by the caller.
+        //
+        // If 'shared_total_bytes' is given, the pool also adds its own
+        // allocations to that counter, and 'preferred_max_bytes' is checked
+        // against the counter rather than against just this pool's allocations.
+        // That lets several pools share one byte budget.
         ParanoiaPool_real(
-                size_t preferred_max_bytes);
+                size_t preferred_max_bytes,
+                void* region,
+                size_t region_num_bytes,
+                std::atomic<size_t>* shared_total_bytes = nullptr);
 
         virtual ~ParanoiaPool_real();
 
@@ -23,13 +38,47 @@ class ParanoiaPool_real {
         void set_prot(void* p, int prot);
         int get_prot(void* p);
 
+        // Resizes a live allocation, with 'realloc' semantics.  Shrinking
+        // happens in place, and the cut-off pages go into quarantine.  Growing
+        // moves the buffer's pages to a new range with 'mremap' rather than
+        // copying them, and the old range goes into quarantine as usual.
+        // Returns nullptr, leaving 'p' untouched, if our address range is
+        // exhausted.
+        void* reallocate(void* p, size_t num_bytes);
+
+        // The number of bytes the caller may use at 'p', i.e. the allocation's
+        // size rounded up to whole pages.
+        size_t usable_size(const void* p) const;
+
         void set_preferred_max_bytes(size_t num_bytes);
 
+        bool owns(const void* p) const;
+
+        // Evicts quarantined allocations while the (possibly shared) byte
+        // budget is exceeded.
+        void gc_as_needed(size_t upcoming_alloc_bytes);
+
     private:
         size_t preferred_max_bytes_;
 
+        char* const region_;
+        const size_t region_num_bytes_;
+        size_t region_num_bytes_used_ = 0;
+
+        // Evicted ranges, already PROT_NONE.  Small ones are kept in exact
+        // per-page-count free lists; larger ones are reused best-fit.
+        static const size_t MAX_SIZE_CLASS_PAGES = 256;
+        std::vector<char*,real_allocator<char*>> size_class_free_ranges_[MAX_SIZE_CLASS_PAGES + 1];
+        std::multimap<size_t,char*,std::less<size_t>,real_allocator<std::pair<const size_t,char*>>> large_free_ranges_;
+
+        std::atomic<size_t>* const shared_total_bytes_;
+
         static const size_t s_page_size_;
 
+        // Below this size, 'reallocate' just copies; a few pages of memcpy are
+        // cheaper than remapping them.
+        static const size_t MREMAP_MIN_BYTES = 64 * 1024;
+
         struct AllocDetails {
             AllocDetails() = default;
 
@@ -49,6 +98,10 @@ class ParanoiaPool_real {
 
         static size_t get_page_size();
         static size_t num_pages_needed(size_t num_bytes);
-        void gc_as_needed(size_t upcoming_alloc_bytes);
         void gc_one_alloc();
+
+        size_t budgeted_total_bytes() const;
+        char* take_range(size_t num_bytes);
+        void store_free_range(char* p, size_t num_bytes);
+        void release_pages(char* p, size_t num_bytes);
 };
@@ -0,0 +1,263 @@
+#include "paranoia_slab_tier.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+ParanoiaSlabTier::ParanoiaSlabTier(
+        size_t max_object_bytes,
+        size_t quarantine_max_bytes,
+        void* region,
+        size_t region_num_bytes) :
+    max_object_bytes_(max_object_bytes),
+    quarantine_max_bytes_(quarantine_max_bytes),
+    region_(static_cast<char*>(region)),
+    region_num_bytes_(region_num_bytes)
+{
+    assert(region_);
+    assert(region_num_bytes_ % SLAB_BYTES == 0);
+    assert(max_object_bytes_ <= class_object_bytes(NUM_CLASSES - 1));
+
+    // Fresh anonymous pages read as zero, i.e. "no slab here yet".
+    void* p = mmap(nullptr, region_num_bytes_ / SLAB_BYTES, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        assert(!"Failed call to mmap.");
+        abort();
+    }
+
+    slab_classes_ = static_cast<unsigned char*>(p);
+
+    void* q = mmap(nullptr, region_num_bytes_ / (size_t(8) << MIN_CLASS_SHIFT), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (q == MAP_FAILED) {
+        assert(!"Failed call to mmap.");
+        abort();
+    }
+
+    free_bits_ = static_cast<unsigned char*>(q);
+}
+
+ParanoiaSlabTier::~ParanoiaSlabTier()
+{
+    // Catch anything that's still sitting in the quarantine.
+    while (! quarantine_.empty()) {
+        evict_one();
+    }
+
+    munmap(slab_classes_, region_num_bytes_ / SLAB_BYTES);
+    munmap(free_bits_, region_num_bytes_ / (size_t(8) << MIN_CLASS_SHIFT));
+}
+
+bool ParanoiaSlabTier::owns(const void* p) const
+{
+    const char* const cp = static_cast<const char*>(p);
+    return (cp >= region_) && (cp < region_ + region_num_bytes_);
+}
+
+size_t ParanoiaSlabTier::get_max_object_bytes() const
+{
+    return max_object_bytes_;
+}
+
+unsigned ParanoiaSlabTier::class_of_size(size_t num_bytes)
+{
+    unsigned shift = MIN_CLASS_SHIFT;
+    while ((size_t(1) << shift) < num_bytes) {
+        ++shift;
+    }
+
+    return shift - MIN_CLASS_SHIFT;
+}
+
+size_t ParanoiaSlabTier::class_object_bytes(unsigned size_class)
+{
+    return size_t(1) << (size_class + MIN_CLASS_SHIFT);
+}
+
+unsigned ParanoiaSlabTier::class_of_object(const void* p) const
+{
+    assert(owns(p));
+
+    const size_t slab_index = size_t(static_cast<const char*>(p) - region_) / SLAB_BYTES;
+    const unsigned char c = slab_classes_[slab_index];
+    if (c == 0) {
+        assert(! "pointer not managed by this ParanoiaSlabTier.");
+        abort();
+    }
+
+    return c - 1;
+}
+
+size_t ParanoiaSlabTier::usable_size(const void* p) const
+{
+    return class_object_bytes(class_of_object(p));
+}
+
+size_t ParanoiaSlabTier::slot_of_object(const void* p) const
+{
+    return size_t(static_cast<const char*>(p) - region_) >> MIN_CLASS_SHIFT;
+}
+
+bool ParanoiaSlabTier::is_free(const void* p) const
+{
+    const size_t slot = slot_of_object(p);
+    return free_bits_[slot / 8] & (1u << (slot % 8));
+}
+
+void ParanoiaSlabTier::set_free(const void* p, bool is_free)
+{
+    const size_t slot = slot_of_object(p);
+    if (is_free) {
+        free_bits_[slot / 8] |= static_cast<unsigned char>(1u << (slot % 8));
+    }
+    else {
+        free_bits_[slot / 8] &= static_cast<unsigned char>(~(1u << (slot % 8)));
+    }
+}
+
+bool ParanoiaSlabTier::add_slab(unsigned size_class)
+{
+    if (region_num_bytes_ - region_num_bytes_used_ < SLAB_BYTES) {
+        return false;
+    }
+
+    char* const slab = region_ + region_num_bytes_used_;
+    if (mprotect(slab, SLAB_BYTES, PROT_READ | PROT_WRITE)) {
+        assert(!"Failed call to mprotect.");
+        abort();
+    }
+
+    region_num_bytes_used_ += SLAB_BYTES;
+    slab_classes_[size_t(slab - region_) / SLAB_BYTES] = static_cast<unsigned char>(size_class + 1);
+
+    SizeClass & c = classes_[size_class];
+    c.bump = slab;
+    c.bump_end = slab + SLAB_BYTES;
+    return true;
+}
+
+void* ParanoiaSlabTier::allocate(size_t num_bytes)
+{
+    assert(num_bytes <= max_object_bytes_);
+
+    const unsigned size_class = class_of_size(num_bytes);
+    SizeClass & c = classes_[size_class];
+
+    if (c.free_list) {
+        void* const p = c.free_list;
+        c.free_list = *static_cast<void**>(p);
+        set_free(p, false);
+        return p;
+    }
+
+    if ((c.bump == c.bump_end) && (! add_slab(size_class))) {
+        return nullptr;
+    }
+
+    void* const p = c.bump;
+    c.bump += class_object_bytes(size_class);
+    return p;
+}
+
+void ParanoiaSlabTier::deallocate(void* p)
+{
+    const unsigned size_class = class_of_object(p);
+    const size_t object_bytes = class_object_bytes(size_class);
+
+    // Each slab holds objects of one size, packed from its start.
+    const size_t offset_in_slab = size_t(static_cast<char*>(p) - region_) % SLAB_BYTES;
+    if (offset_in_slab % object_bytes != 0) {
+        report_invalid_free(p, "not the start of an object");
+    }
+
+    const SizeClass & c = classes_[size_class];
+    if ((static_cast<char*>(p) >= c.bump) && (static_cast<char*>(p) < c.bump_end)) {
+        report_invalid_free(p, "never allocated");
+    }
+
+    if (is_free(p)) {
+        report_invalid_free(p, "double free");
+    }
+
+    set_free(p, true);
+
+    memset(p, POISON_BYTE, object_bytes);
+    quarantine_.push(p);
+    quarantine_bytes_ += object_bytes;
+
+    while (quarantine_bytes_ > quarantine_max_bytes_) {
+        evict_one();
+    }
+}
+
+void ParanoiaSlabTier::evict_one()
+{
+    assert(! quarantine_.empty());
+
+    void* const p = quarantine_.front();
+    quarantine_.pop();
+
+    const unsigned size_class = class_of_object(p);
+    const size_t object_bytes = class_object_bytes(size_class);
+
+    // Objects are at least 16 bytes and naturally aligned, so we can check
+    // the poison a word at a time.
+    uint64_t poison_word;
+    memset(&poison_word, POISON_BYTE, sizeof(poison_word));
+
+    const uint64_t* const words = static_cast<const uint64_t*>(p);
+    for (size_t i = 0; i < object_bytes / sizeof(uint64_t); ++i) {
+        if (words[i] != poison_word) {
+            size_t offset = i * sizeof(uint64_t);
+            while (static_cast<const unsigned char*>(p)[offset] == POISON_BYTE) {
+                ++offset;
+            }
+            report_write_after_free(p, object_bytes, offset);
+        }
+    }
+
+    quarantine_bytes_ -= object_bytes;
+
+    SizeClass & c = classes_[size_class];
+    *static_cast<void**>(p) = c.free_list;
+    c.free_list = p;
+}
+
+void ParanoiaSlabTier::report_invalid_free(const void* p, const char* why)
+{
+    // Stay away from anything that might call malloc.
+    char msg[256];
+    const int len = snprintf(msg, sizeof(msg),
+            "paranoid-malloc-free: invalid free (%s): p=%p\n", why, p);
+
+    if (len > 0) {
+        const ssize_t ignored = write(STDERR_FILENO, msg, size_t(len));
+        (void)ignored;
+    }
+
+    abort();
+}
+
+void ParanoiaSlabTier::report_write_after_free(const void* object, size_t object_bytes, size_t offset)
+{
+    // Stay away from anything that might call malloc.
+    char msg[256];
+    const int len = snprintf(msg, sizeof(msg),
+            "paranoid-malloc-free: write after free detected:"
+            " object=%p object_bytes=%zu first_modified_offset=%zu\n",
+            object, object_bytes, offset);
+
+    if (len > 0) {
+        const ssize_t ignored = write(STDERR_FILENO, msg, size_t(len));
+        (void)ignored;
+    }
+
+    abort();
+}
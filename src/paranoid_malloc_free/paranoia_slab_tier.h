@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <queue>
+
+#include "real_allocator.h"
+
+// A cheaper alternative to ParanoiaPool_real for small allocations.
+//
+// Rounding every small object up to its own page (and VMA) costs far too
+// much memory, so instead objects are packed densely into slabs, one size
+// class per slab.  Page protection can't catch use-after-free here, so on
+// 'deallocate' an object is filled with a poison pattern and held in a FIFO
+// quarantine.  When it's evicted from the quarantine, we check that the
+// poison is intact; if it isn't, something wrote to the object after it was
+// freed, and we report that and abort.  Freeing a pointer that isn't the
+// start of a live object (a double free, or an interior pointer) aborts too.
+//
+// Like ParanoiaPool_real, all memory comes from a caller-supplied PROT_NONE
+// address range, so ownership can be decided with a range check.
+class ParanoiaSlabTier {
+    public:
+        // 'region' must be 'region_num_bytes' of page-aligned, PROT_NONE address
+        // space reserved by the caller.
+        ParanoiaSlabTier(
+                size_t max_object_bytes,
+                size_t quarantine_max_bytes,
+                void* region,
+                size_t region_num_bytes);
+
+        ~ParanoiaSlabTier();
+
+        // Returns nullptr if the tier's address range is exhausted.
+        void* allocate(size_t num_bytes);
+        void deallocate(void* p);
+
+        size_t usable_size(const void* p) const;
+        size_t get_max_object_bytes() const;
+
+        bool owns(const void* p) const;
+
+        static const unsigned char POISON_BYTE = 0xdb;
+
+    private:
+        static const size_t SLAB_BYTES = 64 * 1024;
+        static const unsigned MIN_CLASS_SHIFT = 4; // 16-byte objects
+        static const unsigned MAX_CLASS_SHIFT = 12; // 4 KiB objects
+        static const unsigned NUM_CLASSES = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+        struct SizeClass {
+            void* free_list = nullptr; // Intrusive, through each object's first word.
+            char* bump = nullptr;
+            char* bump_end = nullptr;
+        };
+
+        const size_t max_object_bytes_;
+        const size_t quarantine_max_bytes_;
+
+        char* const region_;
+        const size_t region_num_bytes_;
+        size_t region_num_bytes_used_ = 0;
+
+        SizeClass classes_[NUM_CLASSES];
+
+        // One entry per slab in the region: its size class plus 1, or 0 if the
+        // slab hasn't been handed out yet.
+        unsigned char* slab_classes_;
+
+        // One bit per minimum-size slot in the region, set while the object
+        // starting there is quarantined or on a free list.
+        unsigned char* free_bits_;
+
+        std::queue<void*,std::deque<void*,real_allocator<void*>>> quarantine_;
+        size_t quarantine_bytes_ = 0;
+
+        static unsigned class_of_size(size_t num_bytes);
+        static size_t class_object_bytes(unsigned size_class);
+        unsigned class_of_object(const void* p) const;
+
+        size_t slot_of_object(const void* p) const;
+        bool is_free(const void* p) const;
+        void set_free(const void* p, bool is_free);
+
+        bool add_slab(unsigned size_class);
+        void evict_one();
+        void report_write_after_free(const void* object, size_t object_bytes, size_t offset);
+        void report_invalid_free(const void* p, const char* why);
+};
@@ -1,60 +1,329 @@
 #include <cstdint>
+#include <cstdlib>
+#include <cerrno>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <cassert>
+#include <cstring>
+#include <sys/mman.h>
 
 #include "real_heap_funcs.h"
 #include "paranoia_pool_real.h"
+#include "paranoia_slab_tier.h"
 
 extern "C" {
     void* malloc(size_t size);
     void free(void* p);
+    void* calloc(size_t num_elem, size_t elem_size);
+    void* realloc(void* p, size_t size);
+    int posix_memalign(void** memptr, size_t alignment, size_t size);
+    void* aligned_alloc(size_t alignment, size_t size);
+    size_t malloc_usable_size(void* p);
+
+    // Not part of the malloc family, but for tests and diagnostics.  The
+    // bytes held by all shards, live and quarantined, as checked against
+    // PARANOIA_MAX_BYTES.
+    size_t paranoid_malloc_total_bytes();
+
+    // Whether 'p' is in our guarded address space (either tier), rather than
+    // from the real malloc.
+    int paranoid_malloc_owns(const void* p);
 }
 
 //static void lib_init() __attribute__((constructor));
 //static void lib_deinit() __attribute__((destructor));
 
 static const size_t BILLION = 1000 * 1000 * 1000;
-static const size_t SIZE_OF_GLOBAL_DEFAULT_POOL = 20 * BILLION;
-static ParanoiaPool_real * g_pool;
-static std::mutex * g_mutex;
 
-static bool init_complete = false;
+// Set by the PARANOIA_MAX_BYTES environment variable.  The budget for the
+// bytes held by all shards, live and quarantined together.
+static size_t g_max_bytes = 20 * BILLION;
+
+// The heap is split into independently locked shards, so that threads
+// rarely contend with each other.  Each shard owns one fixed slice of a
+// single reserved address range, which lets 'free' find a pointer's shard
+// with a bit of arithmetic, no matter which thread allocated it.
+static const size_t NUM_SHARDS = 16;
+static const size_t SHARD_SPAN_BYTES = size_t(256) << 30;
+
+// Small allocations are packed into slabs rather than given whole pages.
+// Each shard's slab tier gets its own slice of a second reserved range.
+static const size_t SLAB_SPAN_BYTES = size_t(64) << 30;
+
+// Set by the PARANOIA_SMALL_OBJECT_MAX_BYTES environment variable.
+// Allocations of at most this many bytes go to the slab tier; 0 disables it.
+// The slab tier only detects writes after free, and only when the object
+// leaves quarantine: a read of a freed small object sees the poison pattern
+// instead of faulting.  So it's off by default, and every allocation gets
+// its own protected pages.
+static size_t g_small_object_max_bytes = 0;
+
+// Set by the PARANOIA_SMALL_OBJECT_QUARANTINE_BYTES environment variable.
+// The total bytes of freed small objects held in quarantine, split evenly
+// across the shards.
+static size_t g_small_object_quarantine_bytes = size_t(256) << 20;
+
+struct Shard {
+    std::mutex mutex;
+    ParanoiaPool_real pool;
+    ParanoiaSlabTier slabs;
+
+    Shard(void* region, void* slab_region, std::atomic<size_t>* total_bytes)
+        : pool(g_max_bytes, region, SHARD_SPAN_BYTES, total_bytes),
+          slabs(g_small_object_max_bytes, g_small_object_quarantine_bytes / NUM_SHARDS,
+                  slab_region, SLAB_SPAN_BYTES)
+    {
+    }
+};
+
+static char* g_heap_base;
+static char* g_slab_base;
+static Shard* g_shards;
+
+// Bytes held by all shards, checked against the one global budget.
+static std::atomic<size_t> g_total_bytes(0);
+
+// Where the next round of evicting from other shards' quarantines starts.
+static std::atomic<unsigned> g_next_gc_shard(0);
+
+static std::atomic<unsigned> g_next_home_shard(0);
+
+// Sampling: only one in every 'g_sample_interval' allocations gets a guarded
+// buffer from the shards; the rest go straight to the real malloc.
+// Set by the PARANOIA_SAMPLE_INTERVAL environment variable.  The default, 1,
+// guards every allocation.
+static size_t g_sample_interval = 1;
+
+// Allocations this thread still has to make before its next guarded one.
+static thread_local size_t t_sample_countdown __attribute__((tls_model("initial-exec"))) = 0;
+
+// Per-thread front end: the shard this thread allocates from, assigned
+// round-robin the first time the thread calls malloc.
+static thread_local unsigned t_home_shard __attribute__((tls_model("initial-exec"))) = NUM_SHARDS;
+
+static std::once_flag g_init_flag;
+
+// dlsym, which init_real_heap_funcs calls, may itself call calloc.  That
+// would re-enter lib_init's call_once on the same thread and deadlock.  So
+// while a thread is initializing, its allocations come from a small static
+// bootstrap heap instead.  Bootstrap allocations are never freed.
+static thread_local bool t_initializing __attribute__((tls_model("initial-exec"))) = false;
+
+static const size_t BOOTSTRAP_HEAP_BYTES = 64 * 1024;
+alignas(4096) static char g_bootstrap_heap[BOOTSTRAP_HEAP_BYTES];
+static size_t g_bootstrap_heap_used = 0; // Only touched by the initializing thread.
+
+// Each allocation is preceded by its size, so realloc and
+// malloc_usable_size work on it.  The heap starts out zeroed and is never
+// reused, so these are also fine for calloc.
+static void* bootstrap_allocate(size_t size, size_t alignment = 16)
+{
+    if (alignment < 16) {
+        alignment = 16;
+    }
+
+    const size_t start = (g_bootstrap_heap_used + sizeof(size_t) + alignment - 1) & ~(alignment - 1);
+    if ((alignment > 4096) || (start > BOOTSTRAP_HEAP_BYTES) || (BOOTSTRAP_HEAP_BYTES - start < size)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    g_bootstrap_heap_used = start + size;
+
+    char* const p = g_bootstrap_heap + start;
+    memcpy(p - sizeof(size_t), &size, sizeof(size_t));
+    return p;
+}
+
+static bool is_bootstrap(const void* p)
+{
+    const char* const cp = static_cast<const char*>(p);
+    return (cp >= g_bootstrap_heap) && (cp < g_bootstrap_heap + BOOTSTRAP_HEAP_BYTES);
+}
+
+static size_t bootstrap_usable_size(const void* p)
+{
+    size_t size;
+    memcpy(&size, static_cast<const char*>(p) - sizeof(size_t), sizeof(size_t));
+    return size;
+}
+
+static void lib_init() {
+    t_initializing = true;
+    init_real_heap_funcs();
+
+    // getenv and strtoul don't allocate, so they're safe to call from here.
+    const char* const sample_interval = getenv("PARANOIA_SAMPLE_INTERVAL");
+    if (sample_interval) {
+        const unsigned long n = strtoul(sample_interval, nullptr, 10);
+        if (n > 0) {
+            g_sample_interval = n;
+        }
+    }
+
+    const char* const max_bytes = getenv("PARANOIA_MAX_BYTES");
+    if (max_bytes) {
+        const unsigned long n = strtoul(max_bytes, nullptr, 10);
+        if (n > 0) {
+            g_max_bytes = n;
+        }
+    }
+
+    const char* const small_object_max_bytes = getenv("PARANOIA_SMALL_OBJECT_MAX_BYTES");
+    if (small_object_max_bytes) {
+        const unsigned long n = strtoul(small_object_max_bytes, nullptr, 10);
+        g_small_object_max_bytes = (n < 4096) ? n : 4096;
+    }
+
+    const char* const small_object_quarantine_bytes = getenv("PARANOIA_SMALL_OBJECT_QUARANTINE_BYTES");
+    if (small_object_quarantine_bytes) {
+        g_small_object_quarantine_bytes = strtoul(small_object_quarantine_bytes, nullptr, 10);
+    }
+
+    void* base = mmap(nullptr, NUM_SHARDS * SHARD_SPAN_BYTES, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED);
+    g_heap_base = static_cast<char*>(base);
+
+    void* slab_base = mmap(nullptr, NUM_SHARDS * SLAB_SPAN_BYTES, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(slab_base != MAP_FAILED);
+    g_slab_base = static_cast<char*>(slab_base);
+
+    void* p = real_malloc(NUM_SHARDS * sizeof(Shard));
+    assert(p);
+    g_shards = static_cast<Shard*>(p);
+
+    for (size_t i = 0; i < NUM_SHARDS; ++i) {
+        new (g_shards + i) Shard(
+                g_heap_base + i * SHARD_SPAN_BYTES,
+                g_slab_base + i * SLAB_SPAN_BYTES,
+                &g_total_bytes);
+    }
+
+    t_initializing = false;
+}
 
 static void ensure_lib_init() {
-    if (! init_complete) {
-        init_real_heap_funcs();
+    std::call_once(g_init_flag, lib_init);
+}
+
+static Shard* owning_shard(const void* p) {
+    const char* const cp = static_cast<const char*>(p);
+    if ((cp < g_heap_base) || (cp >= g_heap_base + NUM_SHARDS * SHARD_SPAN_BYTES)) {
+        return nullptr;
+    }
+
+    return g_shards + size_t(cp - g_heap_base) / SHARD_SPAN_BYTES;
+}
+
+static Shard* owning_slab_shard(const void* p) {
+    const char* const cp = static_cast<const char*>(p);
+    if ((cp < g_slab_base) || (cp >= g_slab_base + NUM_SHARDS * SLAB_SPAN_BYTES)) {
+        return nullptr;
+    }
 
-        void* p;
-        p = real_malloc(sizeof(ParanoiaPool_real));
-        assert(p);
-        g_pool = new (p) ParanoiaPool_real(SIZE_OF_GLOBAL_DEFAULT_POOL);
+    return g_shards + size_t(cp - g_slab_base) / SLAB_SPAN_BYTES;
+}
+
+// Allocates from whichever tier suits 'size'.  Caller must hold the shard's lock.
+static void* shard_allocate(Shard & shard, size_t size) {
+    if (size <= g_small_object_max_bytes) {
+        void* p = shard.slabs.allocate(size);
+        if (p) {
+            return p;
+        }
+    }
+
+    return shard.pool.allocate(size);
+}
+
+static bool should_sample() {
+    if (t_sample_countdown == 0) {
+        t_sample_countdown = g_sample_interval - 1;
+        return true;
+    }
+
+    --t_sample_countdown;
+    return false;
+}
+
+static unsigned home_shard() {
+    if (t_home_shard == NUM_SHARDS) {
+        t_home_shard = g_next_home_shard.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS;
+    }
 
-        p = real_malloc(sizeof(std::mutex));
-        assert(p);
-        g_mutex = new (p) std::mutex();
+    return t_home_shard;
+}
 
-        init_complete = true;
+// Each shard's pool can only evict its own quarantine, so a shard whose
+// threads have gone idle would keep its quarantine for good.  While the
+// shared total is over budget, evict from the other shards too, round-robin,
+// skipping any that are busy.  Call without holding any shard's lock.
+static void gc_other_shards()
+{
+    for (unsigned i = 0; (i < NUM_SHARDS) && (g_total_bytes.load(std::memory_order_relaxed) > g_max_bytes); ++i) {
+        Shard & shard = g_shards[g_next_gc_shard.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS];
+        std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            shard.pool.gc_as_needed(0);
+        }
     }
 }
 
-static void lib_deinit() {
-    if (g_pool) {
-        real_free(g_pool);
-        g_pool = nullptr;
+// Allocates a guarded buffer from the shards, bypassing the sampling decision.
+static void* guarded_allocate(size_t size)
+{
+    if (size == 0) {
+        size = 1;
+    }
+
+    // Prefer our home shard, but rather than wait for it, take the first
+    // uncontended shard we find.  Only block if they're all busy.
+    const unsigned home = home_shard();
+    for (unsigned i = 0; i < NUM_SHARDS; ++i) {
+        Shard & shard = g_shards[(home + i) % NUM_SHARDS];
+        std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            void* p = shard_allocate(shard, size);
+            if (p) {
+                lock.unlock();
+                gc_other_shards();
+                return p;
+            }
+        }
     }
 
-    if (g_mutex) {
-        real_free(g_mutex);
-        g_mutex = nullptr;
+    void* p;
+    {
+        Shard & shard = g_shards[home];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        p = shard_allocate(shard, size);
     }
+
+    if (!p) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    gc_other_shards();
+    return p;
 }
 
 void* malloc(size_t size)
 {
+    if (t_initializing) {
+        return bootstrap_allocate(size);
+    }
+
     ensure_lib_init();
-    std::lock_guard<std::mutex> lock(*g_mutex);
-    return g_pool->allocate(size);
+
+    if (! should_sample()) {
+        return real_malloc(size);
+    }
+
+    return guarded_allocate(size);
 }
 
 void free(void* p) {
@@ -62,7 +331,227 @@ void free(void* p) {
         return;
     }
 
+    // Anything freed mid-initialization can only be ours, or memory from
+    // before we were interposed; either way, leave it be.
+    if (is_bootstrap(p) || t_initializing) {
+        return;
+    }
+
+    ensure_lib_init();
+
+    Shard* const shard = owning_shard(p);
+    if (shard) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->pool.deallocate(p);
+        return;
+    }
+
+    Shard* const slab_shard = owning_slab_shard(p);
+    if (slab_shard) {
+        std::lock_guard<std::mutex> lock(slab_shard->mutex);
+        slab_shard->slabs.deallocate(p);
+        return;
+    }
+
+    // An unsampled allocation, or memory that was allocated before our
+    // 'malloc' was interposed.
+    real_free(p);
+}
+
+void* calloc(size_t num_elem, size_t elem_size)
+{
+    size_t size;
+    if (__builtin_mul_overflow(num_elem, elem_size, &size)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    if (t_initializing) {
+        return bootstrap_allocate(size);
+    }
+
+    ensure_lib_init();
+
+    if (! should_sample()) {
+        return real_calloc(num_elem, elem_size);
+    }
+
+    void* p = guarded_allocate(size);
+
+    // The page-protected pool only ever hands out fresh or released anonymous
+    // pages, which the kernel has already zeroed.  Slab objects are recycled,
+    // so they do need clearing.
+    if (p && owning_slab_shard(p)) {
+        memset(p, 0, size);
+    }
+
+    return p;
+}
+
+// Moves a guarded allocation to a new guarded buffer by copying.
+// 'old_usable_size' is how much of 'p' is safe to read.
+static void* guarded_reallocate_by_copy(void* p, size_t old_usable_size, size_t size)
+{
+    void* q = guarded_allocate(size);
+    if (!q) {
+        return nullptr;
+    }
+
+    memcpy(q, p, (size < old_usable_size) ? size : old_usable_size);
+    free(p);
+    return q;
+}
+
+void* realloc(void* p, size_t size)
+{
+    if (!p) {
+        return malloc(size);
+    }
+
+    if (size == 0) {
+        free(p);
+        return nullptr;
+    }
+
+    if (is_bootstrap(p)) {
+        const size_t old_size = bootstrap_usable_size(p);
+        void* q = malloc(size);
+        if (q) {
+            memcpy(q, p, (size < old_size) ? size : old_size);
+        }
+        return q;
+    }
+
+    ensure_lib_init();
+
+    // A guarded allocation stays guarded, regardless of sampling.
+    Shard* const shard = owning_shard(p);
+    if (shard) {
+        size_t old_usable_size;
+        {
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            void* q = shard->pool.reallocate(p, size);
+            if (q) {
+                lock.unlock();
+                gc_other_shards();
+                return q;
+            }
+            old_usable_size = shard->pool.usable_size(p);
+        }
+
+        // This shard's address range is exhausted; try the others.
+        return guarded_reallocate_by_copy(p, old_usable_size, size);
+    }
+
+    Shard* const slab_shard = owning_slab_shard(p);
+    if (slab_shard) {
+        size_t old_usable_size;
+        {
+            std::lock_guard<std::mutex> lock(slab_shard->mutex);
+            old_usable_size = slab_shard->slabs.usable_size(p);
+        }
+
+        if (size <= old_usable_size) {
+            return p;
+        }
+
+        return guarded_reallocate_by_copy(p, old_usable_size, size);
+    }
+
+    return real_realloc(p, size);
+}
+
+// Pool buffers are page-aligned, and each slab object is aligned to its
+// power-of-two size class.  So asking for at least 'alignment' bytes gets
+// suitably aligned memory from either tier, for any alignment up to a page.
+static const size_t MAX_GUARDED_ALIGNMENT = 4096;
+
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if ((alignment < sizeof(void*)) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+
+    if (t_initializing) {
+        void* p = bootstrap_allocate(size, alignment);
+        if (!p) {
+            return ENOMEM;
+        }
+
+        *memptr = p;
+        return 0;
+    }
+
+    ensure_lib_init();
+
+    // Larger alignments are rare enough that we leave them unguarded.
+    if ((alignment > MAX_GUARDED_ALIGNMENT) || (! should_sample())) {
+        return real_posix_memalign(memptr, alignment, size);
+    }
+
+    void* p = guarded_allocate((size < alignment) ? alignment : size);
+    if (!p) {
+        return ENOMEM;
+    }
+
+    *memptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    if ((alignment == 0) || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    if (t_initializing) {
+        return bootstrap_allocate(size, alignment);
+    }
+
+    ensure_lib_init();
+
+    if ((alignment > MAX_GUARDED_ALIGNMENT) || (! should_sample())) {
+        return real_aligned_alloc(alignment, size);
+    }
+
+    return guarded_allocate((size < alignment) ? alignment : size);
+}
+
+size_t malloc_usable_size(void* p)
+{
+    if (!p) {
+        return 0;
+    }
+
+    if (is_bootstrap(p)) {
+        return bootstrap_usable_size(p);
+    }
+
+    ensure_lib_init();
+
+    Shard* const shard = owning_shard(p);
+    if (shard) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        return shard->pool.usable_size(p);
+    }
+
+    Shard* const slab_shard = owning_slab_shard(p);
+    if (slab_shard) {
+        std::lock_guard<std::mutex> lock(slab_shard->mutex);
+        return slab_shard->slabs.usable_size(p);
+    }
+
+    return real_malloc_usable_size(p);
+}
+
+size_t paranoid_malloc_total_bytes()
+{
+    return g_total_bytes.load(std::memory_order_relaxed);
+}
+
+int paranoid_malloc_owns(const void* p)
+{
     ensure_lib_init();
-    std::lock_guard<std::mutex> lock(*g_mutex);
-    g_pool->deallocate(p);
+    return (owning_shard(p) || owning_slab_shard(p)) ? 1 : 0;
 }
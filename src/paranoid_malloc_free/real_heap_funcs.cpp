@@ -9,6 +9,11 @@
 
 void* (*real_malloc)(size_t) = nullptr;
 void (*real_free)(void*) = nullptr;
+void* (*real_calloc)(size_t, size_t) = nullptr;
+void* (*real_realloc)(void*, size_t) = nullptr;
+int (*real_posix_memalign)(void**, size_t, size_t) = nullptr;
+void* (*real_aligned_alloc)(size_t, size_t) = nullptr;
+size_t (*real_malloc_usable_size)(void*) = nullptr;
 
 void init_real_heap_funcs()
 {
@@ -17,4 +22,19 @@ void init_real_heap_funcs()
 
     real_free = reinterpret_cast<void (*)(void*)>(dlsym(RTLD_NEXT, "free"));
     assert(real_free);
+
+    real_calloc = reinterpret_cast<void* (*)(size_t, size_t)>(dlsym(RTLD_NEXT, "calloc"));
+    assert(real_calloc);
+
+    real_realloc = reinterpret_cast<void* (*)(void*, size_t)>(dlsym(RTLD_NEXT, "realloc"));
+    assert(real_realloc);
+
+    real_posix_memalign = reinterpret_cast<int (*)(void**, size_t, size_t)>(dlsym(RTLD_NEXT, "posix_memalign"));
+    assert(real_posix_memalign);
+
+    real_aligned_alloc = reinterpret_cast<void* (*)(size_t, size_t)>(dlsym(RTLD_NEXT, "aligned_alloc"));
+    assert(real_aligned_alloc);
+
+    real_malloc_usable_size = reinterpret_cast<size_t (*)(void*)>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+    assert(real_malloc_usable_size);
 }
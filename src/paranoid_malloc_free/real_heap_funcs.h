@@ -4,5 +4,10 @@
 
 extern void* (*real_malloc)(size_t);
 extern void (*real_free)(void*);
+extern void* (*real_calloc)(size_t, size_t);
+extern void* (*real_realloc)(void*, size_t);
+extern int (*real_posix_memalign)(void**, size_t, size_t);
+extern void* (*real_aligned_alloc)(size_t, size_t);
+extern size_t (*real_malloc_usable_size)(void*);
 
 void init_real_heap_funcs();
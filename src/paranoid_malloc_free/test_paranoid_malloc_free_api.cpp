@@ -0,0 +1,428 @@
+// Checks the interposed malloc family.  Run with libparanoid-malloc-free.so in
+// LD_PRELOAD; without it, only the API checks mean anything.
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+static bool is_interposed() {
+    const char* const preload = getenv("LD_PRELOAD");
+    return preload && strstr(preload, "paranoid-malloc-free");
+}
+
+static size_t small_object_max_bytes() {
+    const char* const s = getenv("PARANOIA_SMALL_OBJECT_MAX_BYTES");
+    return s ? strtoul(s, nullptr, 10) : 0;
+}
+
+static size_t sample_interval() {
+    const char* const s = getenv("PARANOIA_SAMPLE_INTERVAL");
+    const size_t n = s ? strtoul(s, nullptr, 10) : 0;
+    return (n > 0) ? n : 1;
+}
+
+static size_t max_bytes() {
+    const char* const s = getenv("PARANOIA_MAX_BYTES");
+    return s ? strtoul(s, nullptr, 10) : 0;
+}
+
+// A new thread's first allocation is always guarded, whatever
+// PARANOIA_SAMPLE_INTERVAL says.
+static void* guarded_malloc(size_t size) {
+    void* p = nullptr;
+    thread([&p, size]() { p = malloc(size); }).join();
+    return p;
+}
+
+// Runs 'f' in a child process, and returns the signal that killed it, or 0
+// if it exited normally.
+template <typename F>
+static int run_in_child(F f) {
+    const pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        f();
+        _exit(0);
+    }
+
+    int status = 0;
+    const pid_t r = waitpid(pid, &status, 0);
+    assert(r == pid);
+    return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+}
+
+static void test1() {
+    cout << "test1: malloc, calloc, realloc" << endl;
+
+    char* p = static_cast<char*>(malloc(100));
+    assert(p);
+    assert(malloc_usable_size(p) >= 100);
+    memset(p, 'a', 100);
+
+    p = static_cast<char*>(realloc(p, 10000));
+    assert(p);
+    assert(malloc_usable_size(p) >= 10000);
+    for (size_t i = 0; i < 100; ++i) {
+        assert(p[i] == 'a');
+    }
+    memset(p, 'b', 10000);
+
+    p = static_cast<char*>(realloc(p, 50));
+    assert(p);
+    for (size_t i = 0; i < 50; ++i) {
+        assert(p[i] == 'b');
+    }
+    free(p);
+
+    // realloc(nullptr, n) is malloc(n), and realloc(p, 0) is free(p).
+    p = static_cast<char*>(realloc(nullptr, 200));
+    assert(p);
+    assert(malloc_usable_size(p) >= 200);
+    memset(p, 'c', 200);
+    assert(realloc(p, 0) == nullptr);
+
+    unsigned* q = static_cast<unsigned*>(calloc(1000, sizeof(unsigned)));
+    assert(q);
+    for (size_t i = 0; i < 1000; ++i) {
+        assert(q[i] == 0);
+    }
+    free(q);
+
+    volatile size_t huge_count = SIZE_MAX / 2;
+    errno = 0;
+    assert(calloc(huge_count, 3) == nullptr);
+    assert(errno == ENOMEM);
+
+    free(nullptr);
+    assert(malloc_usable_size(nullptr) == 0);
+}
+
+static void test2() {
+    cout << "test2: posix_memalign, aligned_alloc" << endl;
+
+    for (size_t alignment = sizeof(void*); alignment <= 8192; alignment *= 2) {
+        void* p = nullptr;
+        assert(posix_memalign(&p, alignment, 24) == 0);
+        assert(p);
+        assert(reinterpret_cast<uintptr_t>(p) % alignment == 0);
+        memset(p, 0, 24);
+        free(p);
+
+        void* q = aligned_alloc(alignment, alignment * 3);
+        assert(q);
+        assert(reinterpret_cast<uintptr_t>(q) % alignment == 0);
+        memset(q, 0, alignment * 3);
+        free(q);
+    }
+
+    void* p = nullptr;
+    assert(posix_memalign(&p, 24, 100) == EINVAL);
+    assert(posix_memalign(&p, 2, 100) == EINVAL);
+
+    // Older glibcs accept any alignment here, so only check ours.
+    if (is_interposed()) {
+        errno = 0;
+        assert(aligned_alloc(24, 100) == nullptr);
+        assert(errno == EINVAL);
+    }
+}
+
+static void test3() {
+    cout << "test3: concurrent malloc / free across threads" << endl;
+
+    const size_t NUM_THREADS = 8;
+    const size_t NUM_ITERS = 2000;
+
+    // Each thread frees half of what it allocates, and hands the rest to
+    // the main thread, so frees cross shards.
+    vector<vector<void*>> handed_off(NUM_THREADS);
+    vector<thread> threads;
+    for (size_t t = 0; t < NUM_THREADS; ++t) {
+        threads.emplace_back([t, &handed_off]() {
+            for (size_t i = 0; i < NUM_ITERS; ++i) {
+                const size_t size = 1 + (i * 37 + t) % 5000;
+                char* p = static_cast<char*>(malloc(size));
+                assert(p);
+                p[0] = char(t);
+                p[size - 1] = char(t);
+                if (i % 2) {
+                    free(p);
+                } else {
+                    handed_off[t].push_back(p);
+                }
+            }
+        });
+    }
+
+    for (auto & th : threads) {
+        th.join();
+    }
+
+    for (size_t t = 0; t < NUM_THREADS; ++t) {
+        for (void* p : handed_off[t]) {
+            assert(static_cast<char*>(p)[0] == char(t));
+            free(p);
+        }
+    }
+}
+
+static void test4() {
+    cout << "test4: use after free" << endl;
+
+    if (! is_interposed()) {
+        cout << "  skipped: libparanoid-malloc-free.so isn't in LD_PRELOAD" << endl;
+        return;
+    }
+
+    // Large buffers always get their own pages, so a read after free faults.
+    const int large_sig = run_in_child([]() {
+        volatile char* p = static_cast<char*>(guarded_malloc(100000));
+        p[0] = 1;
+        free(const_cast<char*>(p));
+        (void) p[0];
+    });
+    assert(large_sig == SIGSEGV);
+
+    const int small_sig = run_in_child([]() {
+        volatile char* p = static_cast<char*>(guarded_malloc(16));
+        p[0] = 1;
+        free(const_cast<char*>(p));
+        (void) p[0];
+    });
+
+    if (small_object_max_bytes() < 16) {
+        // With the slab tier off, small buffers are protected too.
+        assert(small_sig == SIGSEGV);
+    } else {
+        // The slab tier can't catch reads, but it does catch a write once
+        // the object is evicted from quarantine.
+        assert(small_sig == 0);
+
+        const int write_sig = run_in_child([]() {
+            // All in one new thread, so that its first allocation is
+            // guarded, and the churn goes through the same shard's quarantine.
+            thread([]() {
+                volatile char* p = static_cast<char*>(malloc(16));
+                free(const_cast<char*>(p));
+                p[3] = 1;
+                // Push the object out of quarantine.
+                for (size_t i = 0; i < 4 * 1024 * 1024 * sample_interval(); ++i) {
+                    void* volatile q = malloc(16);
+                    free(q);
+                }
+            }).join();
+        });
+        assert(write_sig == SIGABRT);
+    }
+}
+
+static void test5() {
+    cout << "test5: one byte budget across shards" << endl;
+
+    const size_t budget = max_bytes();
+    if ((! is_interposed()) || (budget == 0)) {
+        cout << "  skipped: needs the interposer, and PARANOIA_MAX_BYTES" << endl;
+        return;
+    }
+
+    using total_bytes_func = size_t (*)();
+    const auto total_bytes = reinterpret_cast<total_bytes_func>(dlsym(RTLD_DEFAULT, "paranoid_malloc_total_bytes"));
+    assert(total_bytes);
+
+    const size_t chunk_bytes = 1024 * 1024;
+    const size_t num_chunks = budget / chunk_bytes;
+
+    // Another thread allocates three quarters of the budget and exits.  We
+    // free its buffers, which quarantines them in its (now idle) shard.
+    vector<void*> theirs;
+    thread([&theirs, num_chunks, chunk_bytes]() {
+        for (size_t i = 0; i < num_chunks * 3 / 4; ++i) {
+            theirs.push_back(malloc(chunk_bytes));
+        }
+    }).join();
+
+    for (void* p : theirs) {
+        assert(p);
+        free(p);
+    }
+
+    // Going over budget from this thread's shard has to evict from that one.
+    vector<void*> ours;
+    for (size_t i = 0; i < num_chunks / 2; ++i) {
+        ours.push_back(malloc(chunk_bytes));
+        assert(ours.back());
+        assert(total_bytes() <= budget);
+    }
+
+    for (void* p : ours) {
+        free(p);
+    }
+}
+
+static void test6() {
+    cout << "test6: sampled and unsampled allocations" << endl;
+
+    if (! is_interposed()) {
+        cout << "  skipped: libparanoid-malloc-free.so isn't in LD_PRELOAD" << endl;
+        return;
+    }
+
+    using owns_func = int (*)(const void*);
+    const auto owns = reinterpret_cast<owns_func>(dlsym(RTLD_DEFAULT, "paranoid_malloc_owns"));
+    assert(owns);
+
+    // A new thread starts its countdown afresh, so its first allocation is
+    // guarded, then every Nth after it.  Nothing else in the thread may
+    // allocate meanwhile.
+    const size_t interval = sample_interval();
+    const size_t num_allocs = 4 * interval + 1;
+    vector<char*> ptrs(num_allocs);
+
+    thread([&ptrs, num_allocs]() {
+        for (size_t i = 0; i < num_allocs; ++i) {
+            ptrs[i] = static_cast<char*>(malloc(3000));
+        }
+    }).join();
+
+    size_t num_owned = 0;
+    for (size_t i = 0; i < num_allocs; ++i) {
+        char* const p = ptrs[i];
+        assert(p);
+        assert(bool(owns(p)) == (i % interval == 0));
+        num_owned += owns(p);
+
+        assert(malloc_usable_size(p) >= 3000);
+        memset(p, char(i), 3000);
+    }
+    assert(num_owned == 5);
+
+    // Each kind stays with its own allocator across realloc, including the
+    // guarded one's mremap path.
+    for (size_t i = 0; i < num_allocs; ++i) {
+        const bool owned = owns(ptrs[i]);
+        const size_t new_size = (i % 2) ? 200 * 1024 : 100;
+
+        char* const p = static_cast<char*>(realloc(ptrs[i], new_size));
+        assert(p);
+        assert(bool(owns(p)) == owned);
+        assert(malloc_usable_size(p) >= new_size);
+        for (size_t j = 0; j < std::min(new_size, size_t(3000)); ++j) {
+            assert(p[j] == char(i));
+        }
+
+        ptrs[i] = p;
+    }
+
+    for (char* p : ptrs) {
+        free(p);
+    }
+}
+
+static void test7() {
+    cout << "test7: invalid frees" << endl;
+
+    if (! is_interposed()) {
+        cout << "  skipped: libparanoid-malloc-free.so isn't in LD_PRELOAD" << endl;
+        return;
+    }
+
+    const int double_free_sig = run_in_child([]() {
+        void* volatile p = guarded_malloc(16);
+        free(p);
+        free(p);
+    });
+    assert(double_free_sig == SIGABRT);
+
+    const int interior_sig = run_in_child([]() {
+        char* const p = static_cast<char*>(guarded_malloc(32));
+        char* volatile interior = p + 16;
+        free(interior);
+    });
+    assert(interior_sig == SIGABRT);
+
+    if (small_object_max_bytes() >= 16) {
+        // A slab object that's been evicted from quarantine sits on a free
+        // list; freeing it again mustn't corrupt that.
+        const int evicted_sig = run_in_child([]() {
+            thread([]() {
+                void* volatile p = malloc(16);
+                free(p);
+                for (size_t i = 0; i < 4 * 1024 * 1024 * sample_interval(); ++i) {
+                    void* volatile q = malloc(32);
+                    free(q);
+                }
+                free(p);
+            }).join();
+        });
+        assert(evicted_sig == SIGABRT);
+    }
+}
+
+static void test8() {
+    cout << "test8: growing a large guarded buffer in place" << endl;
+
+    if (! is_interposed()) {
+        cout << "  skipped: libparanoid-malloc-free.so isn't in LD_PRELOAD" << endl;
+        return;
+    }
+
+    using owns_func = int (*)(const void*);
+    const auto owns = reinterpret_cast<owns_func>(dlsym(RTLD_DEFAULT, "paranoid_malloc_owns"));
+    assert(owns);
+
+    // Buffers of 64 KiB and up are grown with mremap, which moves the pages
+    // rather than copying them, and must leave the old range inaccessible.
+    const int sig = run_in_child([owns]() {
+        const size_t old_size = 128 * 1024;
+        const size_t new_size = 1024 * 1024;
+
+        char* const p = static_cast<char*>(guarded_malloc(old_size));
+        assert(p);
+        assert(owns(p));
+        for (size_t i = 0; i < old_size; ++i) {
+            p[i] = char(i * 7);
+        }
+
+        char* const q = static_cast<char*>(realloc(p, new_size));
+        assert(q);
+        assert(owns(q));
+        assert(malloc_usable_size(q) >= new_size);
+        for (size_t i = 0; i < old_size; ++i) {
+            assert(q[i] == char(i * 7));
+        }
+        memset(q + old_size, 0, new_size - old_size);
+
+        if (q != p) {
+            volatile char* const stale = p;
+            (void) stale[0];
+        }
+    });
+
+    // Either the buffer moved and the stale read faulted, or it grew in place.
+    assert((sig == SIGSEGV) || (sig == 0));
+}
+
+int main() {
+    test1();
+    test2();
+    test3();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    return 0;
+}
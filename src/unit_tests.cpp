@@ -1,12 +1,26 @@
 #include "util.h"
 #include "paranoia_pool.h"
 #include "paranoia_allocator.h"
+#include "paranoia_parallel.h"
 #include "paranoid_vector.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <iostream>
+#include <random>
+#include <set>
+#include <sstream>
 #include <string>
 #include <limits>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -182,10 +196,982 @@ void test5() {
     cout << endl;
 }
 
+void test6() {
+    cout << endl;
+
+    paranoid_vector<int> v1;
+
+    size_t num_reallocs = 0;
+    const int* last_data = v1.data();
+
+    for (int i = 0; i < 100000; ++i) {
+        v1.push_back(i);
+        if (v1.data() != last_data) {
+            ++num_reallocs;
+            last_data = v1.data();
+        }
+    }
+
+    cout << "v1.size() = " << v1.size() << endl;
+    cout << "v1.capacity() = " << v1.capacity() << endl;
+    cout << "num_reallocs = " << num_reallocs << endl;
+
+    for (int i = 0; i < 100000; ++i) {
+        assert(v1[i] == i);
+    }
+
+    v1.resize(10);
+    v1.shrink_to_fit();
+    cout << "after resize(10) + shrink_to_fit(): v1.capacity() = " << v1.capacity() << endl;
+
+    paranoid_vector<int> v2;
+    v2.reserve(5000);
+    const size_t reserved_capacity = v2.capacity();
+    for (int i = 0; i < 5000; ++i) {
+        v2.push_back(i);
+    }
+    assert(v2.capacity() == reserved_capacity);
+    cout << "v2.capacity() = " << v2.capacity() << endl;
+
+    while (! v2.empty()) {
+        v2.pop_back();
+    }
+    cout << "v2.size() after pop_back loop = " << v2.size() << endl;
+
+    // Inserting into spare capacity mustn't grow it.
+    paranoid_vector<int> v3;
+    for (int i = 0; i < 1000; ++i) {
+        v3.insert(v3.begin(), i);
+    }
+    cout << "v3.capacity() after 1000 inserts = " << v3.capacity() << endl;
+    assert(v3.size() == 1000);
+    assert(v3.capacity() < 4 * 1000);
+    assert(v3[0] == 999);
+}
+
+void test7() {
+    cout << endl;
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000000, 1000);
+
+    int local = 0;
+    void* p1 = ppool->allocate(100);
+    void* p2 = ppool->allocate(10000);
+
+    cout << "ppool->owns(p1) = " << ppool->owns(p1) << endl;
+    cout << "ppool->owns(p2) = " << ppool->owns(p2) << endl;
+    cout << "ppool->owns(&local) = " << ppool->owns(&local) << endl;
+    assert(ppool->owns(p1));
+    assert(ppool->owns(p2));
+    assert(! ppool->owns(&local));
+
+    ppool->deallocate(p1);
+    assert(ppool->owns(p1));
+
+    ppool->deallocate(p2);
+
+    // Quarantined buffers keep their address space but not their memory.
+    cout << "ppool->get_resident_bytes() = " << ppool->get_resident_bytes() << endl;
+    cout << "ppool->get_reserved_bytes() = " << ppool->get_reserved_bytes() << endl;
+    assert(ppool->get_resident_bytes() == 0);
+    assert(ppool->get_reserved_bytes() > 0);
+}
+
+void test8() {
+    cout << endl;
+
+    // Enough live buffers to make the pool's metadata table grow several
+    // times, released in random order to exercise its deletion path.
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100000);
+
+    std::vector<void*> bufs;
+    for (int i = 0; i < 20000; ++i) {
+        const int prot = (i % 2) ? PROT_READ : (PROT_READ | PROT_WRITE);
+        bufs.push_back(ppool->allocate(1 + (i % 3) * 4096, prot));
+    }
+
+    std::mt19937 rng(42);
+    std::shuffle(bufs.begin(), bufs.end(), rng);
+
+    for (size_t i = 0; i < bufs.size(); ++i) {
+        for (size_t j = i; j < std::min(bufs.size(), i + 8); ++j) {
+            const int prot = ppool->get_prot(bufs[j]);
+            assert((prot == PROT_READ) || (prot == (PROT_READ | PROT_WRITE)));
+        }
+        ppool->deallocate(bufs[i]);
+    }
+
+    cout << "allocated and released " << bufs.size() << " buffers" << endl;
+    assert(ppool->get_resident_bytes() == 0);
+}
+
+void test9() {
+    cout << endl;
+
+    // With a shallow quarantine, a steady-state workload should keep cycling
+    // through the same few recycled ranges.
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 8);
+
+    std::set<void*> addrs;
+    for (int i = 0; i < 1000; ++i) {
+        void* p = ppool->allocate(3 * ParanoiaPool::get_page_size());
+        addrs.insert(p);
+        ppool->deallocate(p);
+    }
+
+    cout << "distinct addresses used = " << addrs.size() << endl;
+    assert(addrs.size() <= 16);
+
+    // Freed neighbouring large ranges merge, so one buffer the size of
+    // several of them fits where they were.
+    const size_t large_bytes = 300 * ParanoiaPool::get_page_size(); // Too big for the size classes.
+    auto ppool2 = std::make_shared<ParanoiaPool>(1000*1000*1000, 2);
+
+    char* large[10];
+    for (auto & p : large) {
+        p = static_cast<char*>(ppool2->allocate(large_bytes));
+    }
+    void* const sentinel = ppool2->allocate(ParanoiaPool::get_page_size());
+
+    for (size_t i = 1; i < 10; ++i) {
+        assert(large[i] == large[i - 1] + large_bytes);
+    }
+
+    for (auto p : large) {
+        ppool2->deallocate(p);
+    }
+
+    void* const merged = ppool2->allocate(9 * large_bytes);
+    cout << "merged == large[0]: " << (merged == large[0]) << endl;
+    assert(merged == large[0]);
+
+    ppool2->deallocate(merged);
+    ppool2->deallocate(sentinel);
+}
+
+void test10() {
+    cout << endl;
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 1000);
+
+    void* p1 = ppool->allocate(4096);
+    void* p2 = ppool->allocate(4096);
+    void* p3 = ppool->allocate(8192, PROT_READ | PROT_WRITE, 4096);
+
+    // Intermediate states for p3 are skipped; only the final one is applied.
+    ParanoiaPool::ProtPlan plan;
+    plan.set_prot(p3, PROT_READ);
+    plan.set_prot(p1, PROT_READ);
+    plan.deallocate(p1);
+    plan.deallocate(p2);
+    plan.set_prot_prefix(p3, 100, PROT_READ | PROT_WRITE);
+    ppool->apply(plan);
+
+    cout << "ppool->get_prot(p3) = " << ppool->get_prot(p3) << endl;
+    assert(ppool->get_prot(p3) == (PROT_READ | PROT_WRITE));
+    static_cast<char*>(p3)[0] = 1;
+
+    ppool->deallocate(p3);
+    assert(ppool->get_resident_bytes() == 0);
+}
+
+void test11() {
+    cout << endl;
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+    ppool->start_background_drain();
+
+    // Churn well past the allocation budget.  Request threads only step in
+    // once the quarantine is HARD_LIMIT_FACTOR times over.
+    for (int i = 0; i < 10000; ++i) {
+        ppool->deallocate(ppool->allocate(4096));
+    }
+
+    for (int i = 0; (i < 1000) && (ppool->get_drain_backlog_allocs() > 0); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    cout << "ppool->get_drain_backlog_allocs() = " << ppool->get_drain_backlog_allocs() << endl;
+    assert(ppool->get_drain_backlog_allocs() == 0);
+
+    // The drain thread fills the quarantine right up to the budget; it has no
+    // upcoming allocation to make room for.
+    cout << "ppool->get_stats().num_stale_allocs = " << ppool->get_stats().num_stale_allocs << endl;
+    assert(ppool->get_stats().num_stale_allocs == 100);
+
+    ppool->stop_background_drain();
+}
+
+// Copy-only, and its copy constructor throws once 'copies_until_throw'
+// reaches zero.
+struct CopyThrower {
+    static int copies_until_throw;
+    static int num_live;
+
+    int value;
+
+    explicit CopyThrower(int v) : value(v) { ++num_live; }
+
+    CopyThrower(const CopyThrower & other) : value(other.value) {
+        if (copies_until_throw == 0) {
+            throw std::runtime_error("CopyThrower: copy failed");
+        }
+        if (copies_until_throw > 0) {
+            --copies_until_throw;
+        }
+        ++num_live;
+    }
+
+    CopyThrower & operator=(const CopyThrower &) = default;
+
+    ~CopyThrower() { --num_live; }
+};
+
+int CopyThrower::copies_until_throw = -1;
+int CopyThrower::num_live = 0;
+
+void test12() {
+    cout << endl;
+
+    paranoid_vector<std::unique_ptr<int>> v1;
+    for (int i = 0; i < 1000; ++i) {
+        v1.push_back(std::make_unique<int>(i));
+    }
+    v1.emplace(v1.begin(), new int(-1));
+
+    const auto* const v1_data = v1.data();
+
+    // Moves and swaps hand over the buffer itself.
+    paranoid_vector<std::unique_ptr<int>> v2(std::move(v1));
+    assert(v1.empty());
+    assert(v2.data() == v1_data);
+
+    paranoid_vector<std::unique_ptr<int>> v3;
+    v3 = std::move(v2);
+    assert(v3.data() == v1_data);
+
+    paranoid_vector<std::unique_ptr<int>> v4;
+    swap(v3, v4);
+    assert(v3.empty());
+    assert(v4.data() == v1_data);
+
+    cout << "v4.size() = " << v4.size() << endl;
+    assert(v4.size() == 1001);
+    assert(*v4[0] == -1);
+    assert(*v4[1000] == 999);
+
+    paranoid_vector<std::string> v5;
+    const std::string s(100, 'x');
+    v5.push_back(s);
+    v5.emplace_back(10, 'y');
+    v5.insert(v5.begin(), std::string("z"));
+    assert(v5[0] == "z");
+    assert(v5[1] == s);
+    assert(v5[2] == std::string(10, 'y'));
+
+    // An operation whose allocation or copy throws leaves the vector as it was.
+    paranoid_vector<CopyThrower> v6;
+    for (int i = 0; i < 100; ++i) {
+        v6.push_back(CopyThrower(i));
+    }
+    v6.shrink_to_fit();
+
+    // Fill the last page, so that growing has to relocate.
+    while (v6.size() < v6.capacity()) {
+        v6.push_back(CopyThrower(int(v6.size())));
+    }
+    const int n = int(v6.size());
+
+    const auto check_unchanged = [&v6, n]() {
+        assert(int(v6.size()) == n);
+        for (int i = 0; i < n; ++i) {
+            assert(v6[i].value == i);
+        }
+        assert(CopyThrower::num_live == n);
+    };
+
+    const auto expect_throw = [](auto f) {
+        // Let a few copies succeed first, so the failure is part-way through.
+        CopyThrower::copies_until_throw = 50;
+        bool threw = false;
+        try {
+            f();
+        }
+        catch (const std::runtime_error &) {
+            threw = true;
+        }
+        CopyThrower::copies_until_throw = -1;
+        assert(threw);
+    };
+
+    expect_throw([&v6]() { v6.push_back(CopyThrower(-1)); });
+    check_unchanged();
+    expect_throw([&v6, n]() { v6.reserve(4 * n); });
+    check_unchanged();
+    expect_throw([&v6]() { v6.insert(v6.begin() + 10, CopyThrower(-1)); });
+    check_unchanged();
+    expect_throw([&v6, n]() { v6.resize(4 * n, CopyThrower(-1)); });
+    check_unchanged();
+
+    paranoid_vector<CopyThrower> v7;
+    v7.push_back(CopyThrower(-1));
+    CopyThrower::copies_until_throw = 0;
+    try {
+        v7 = v6;
+    }
+    catch (const std::runtime_error &) {
+    }
+    CopyThrower::copies_until_throw = -1;
+    assert((v7.size() == 1) && (v7[0].value == -1));
+
+    v6.clear();
+    v7.clear();
+    assert(CopyThrower::num_live == 0);
+}
+
+void test13() {
+    cout << endl;
+
+    paranoid_vector<int> v;
+    for (int i = 0; i < 10000; ++i) {
+        v.push_back(i);
+    }
+
+    // The erase-remove idiom, in one relocation.
+    v.erase(std::remove_if(v.begin(), v.end(), [](int x) { return x % 2; }), v.end());
+    cout << "v.size() = " << v.size() << endl;
+    assert(v.size() == 5000);
+    assert(v[4999] == 9998);
+
+    auto iter = v.erase(v.begin() + 1, v.begin() + 4999);
+    assert(v.size() == 2);
+    assert(*iter == 9998);
+
+    v.insert(v.begin() + 1, 3, 7);
+    v.insert(v.end(), {1, 2});
+    const paranoid_vector<int> expected{0, 7, 7, 7, 9998, 1, 2};
+    assert(v == expected);
+
+    std::set<int> s{20, 21};
+    v.insert_range(v.begin(), s);
+    assert(v[0] == 20);
+    assert(v[1] == 21);
+    assert(v.size() == 9);
+
+    v.reserve(100);
+    const int* const data = v.data();
+    v.append_range(std::vector<int>(10, 5));
+    assert(v.data() == data);
+    assert(v.size() == 19);
+
+    std::istringstream in("40 41 42");
+    v.insert(v.begin(), std::istream_iterator<int>(in), std::istream_iterator<int>());
+    assert(v.size() == 22);
+    assert(v[2] == 42);
+    assert(v[3] == 20);
+}
+
+void test14() {
+    cout << endl;
+
+    static_assert(std::is_same<paranoid_vector_t<int, paranoia_passthrough>, std::vector<int>>::value, "");
+    static_assert(std::is_same<paranoid_vector_t<int, paranoia_full_checks>, paranoid_vector<int>>::value, "");
+
+    paranoid_vector<float, paranoia_quarantine_only> v(1000, 1.0f);
+
+    float sum = 0;
+    for (size_t i = 0; i < v.size(); ++i) {
+        sum += v[i];
+    }
+    assert(sum == 1000.0f);
+
+    bool threw = false;
+    try {
+        v.at(1000);
+    }
+    catch (const std::out_of_range &) {
+        threw = true;
+    }
+    cout << "threw = " << threw << endl;
+    assert(threw);
+}
+
+void test15() {
+    cout << endl;
+
+    // Big enough that relocations take the streaming-copy path.
+    const size_t num_elem = 4 * PARANOIA_STREAMING_COPY_MIN_BYTES / sizeof(float) + 3;
+
+    paranoid_vector<float> v1;
+    for (size_t i = 0; i < num_elem; ++i) {
+        v1.push_back(float(i));
+    }
+
+    paranoid_vector<float> v2(v1);
+    v2.shrink_to_fit();
+    assert(v2 == v1);
+
+    v2.erase(v2.begin() + 1);
+    assert(v2 != v1);
+    assert(v2[num_elem - 2] == float(num_elem - 1));
+
+    paranoid_vector<int> v3{1, 2, 3};
+    paranoid_vector<int> v4{1, 2, 4};
+    cout << "(v3 == v4) = " << (v3 == v4) << endl;
+    assert(v3 != v4);
+}
+
+void test16() {
+    cout << endl;
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 10);
+
+    for (int i = 0; i < 100; ++i) {
+        void* p = ppool->allocate(3 * 4096);
+        ppool->set_prot(p, PROT_READ);
+        ppool->deallocate(p);
+    }
+
+    void* p = ppool->allocate(4096);
+
+    const ParanoiaPool::Stats s = ppool->get_stats();
+    cout << "s.num_live_allocs = " << s.num_live_allocs << endl;
+    cout << "s.num_stale_allocs = " << s.num_stale_allocs << endl;
+    cout << "s.num_evictions = " << s.num_evictions << endl;
+    cout << "s.num_mprotect_calls = " << s.num_mprotect_calls << endl;
+    cout << "s.allocate_latency p50 <= " << s.allocate_latency.quantile_upper_bound_ns(0.5) << " ns" << endl;
+
+    assert(s.num_live_allocs == 1);
+    assert(s.live_bytes == 4096);
+    // The allocation budget counts live and quarantined allocations alike.
+    assert(s.num_stale_allocs == 9);
+    assert(s.num_evictions == 91);
+    assert(s.num_evicted_bytes == 91 * 3 * 4096);
+    assert(s.num_mprotect_calls == 201);
+    assert(s.num_alloc_failures == 0);
+    assert(s.allocate_latency.total_count() == 101);
+    assert(s.deallocate_latency.total_count() == 100);
+    assert(s.set_prot_latency.total_count() == 100);
+
+    ppool->deallocate(p);
+}
+
+static char* g_test17_guard_page = nullptr;
+
+void test17() {
+    cout << endl;
+
+    // The child touches a freed buffer, which should be reported on stderr and
+    // then kill it with SIGSEGV as usual.
+    const pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+        ppool->enable_fault_reporting();
+
+        char* p = static_cast<char*>(ppool->allocate(4096));
+        p[0] = 'x';
+        ppool->deallocate(p);
+
+        *static_cast<volatile char*>(p + 10) = 'y';
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid);
+
+    cout << "child terminated by signal " << (WIFSIGNALED(status) ? WTERMSIG(status) : 0) << endl;
+    assert(WIFSIGNALED(status));
+    assert(WTERMSIG(status) == SIGSEGV);
+
+    // A SIGSEGV handler installed before fault reporting still gets faults
+    // outside the pool (here it recovers from them), and gets the pool's
+    // faults once they're reported.
+    const pid_t pid2 = fork();
+    assert(pid2 >= 0);
+
+    if (pid2 == 0) {
+        struct sigaction prev_action;
+        memset(&prev_action, 0, sizeof(prev_action));
+        prev_action.sa_sigaction = [](int, siginfo_t* info, void*) {
+            if (info->si_addr == g_test17_guard_page) {
+                mprotect(g_test17_guard_page, 4096, PROT_READ | PROT_WRITE);
+                return;
+            }
+            _exit(42);
+        };
+        prev_action.sa_flags = SA_SIGINFO;
+        sigemptyset(&prev_action.sa_mask);
+        sigaction(SIGSEGV, &prev_action, nullptr);
+
+        auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+        ppool->enable_fault_reporting();
+
+        char* p = static_cast<char*>(ppool->allocate(4096));
+        ppool->deallocate(p);
+
+        void* guard = mmap(nullptr, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(guard != MAP_FAILED);
+        g_test17_guard_page = static_cast<char*>(guard);
+        *static_cast<volatile char*>(g_test17_guard_page) = 'z';
+
+        // The pool's handler must still be the one installed.
+        struct sigaction current;
+        sigaction(SIGSEGV, nullptr, &current);
+        if (current.sa_sigaction == prev_action.sa_sigaction) {
+            _exit(1);
+        }
+
+        *static_cast<volatile char*>(p) = 'y';
+        _exit(0);
+    }
+
+    assert(waitpid(pid2, &status, 0) == pid2);
+    cout << "child exited with " << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << endl;
+    assert(WIFEXITED(status));
+    assert(WEXITSTATUS(status) == 42);
+}
+
+void test18() {
+    cout << endl;
+
+    // Several threads allocate, and each buffer is freed by the next thread
+    // over, all within a tight allocation budget.
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+
+    const size_t num_threads = 8;
+    const size_t num_allocs_per_thread = 2000;
+
+    std::vector<std::vector<char*>> handoffs(num_threads);
+    std::vector<std::mutex> handoff_mutexes(num_threads);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t]() {
+            const size_t next = (t + 1) % num_threads;
+
+            for (size_t i = 0; i < num_allocs_per_thread; ++i) {
+                char* p = static_cast<char*>(ppool->allocate(4096 * (1 + i % 3)));
+                p[0] = char(t);
+
+                // Other threads are adding regions to the directory meanwhile.
+                assert(ppool->owns(p));
+                assert(ppool->owns(p + 4095));
+                assert(! ppool->owns(&next));
+
+                {
+                    std::lock_guard<std::mutex> lock(handoff_mutexes[next]);
+                    handoffs[next].push_back(p);
+                }
+
+                std::vector<char*> mine;
+                {
+                    std::lock_guard<std::mutex> lock(handoff_mutexes[t]);
+                    mine.swap(handoffs[t]);
+                }
+
+                for (char* q : mine) {
+                    assert(q[0] == char((t + num_threads - 1) % num_threads));
+                    ppool->deallocate(q);
+                }
+            }
+        });
+    }
+
+    for (std::thread & t : threads) {
+        t.join();
+    }
+
+    for (std::vector<char*> & h : handoffs) {
+        for (char* q : h) {
+            ppool->deallocate(q);
+        }
+    }
+
+    const ParanoiaPool::Stats s = ppool->get_stats();
+    cout << "s.num_live_allocs = " << s.num_live_allocs << endl;
+    cout << "s.num_stale_allocs = " << s.num_stale_allocs << endl;
+    cout << "s.num_evictions = " << s.num_evictions << endl;
+
+    assert(s.num_live_allocs == 0);
+    assert(s.live_bytes == 0);
+    assert(s.num_stale_allocs <= 100);
+    assert(s.num_stale_allocs + s.num_evictions == num_threads * num_allocs_per_thread);
+}
+
+void test19() {
+    cout << endl;
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+    auto allocator = std::make_shared<paranoia_allocator<int>>(ppool);
+
+    // Big enough that growth moves pages instead of copying elements.
+    const size_t n = 4 * ParanoiaPool::REMAP_MIN_BYTES / sizeof(int);
+
+    paranoid_vector<int> v(allocator);
+    for (size_t i = 0; i < n; ++i) {
+        v.push_back(int(i));
+    }
+
+    const uint64_t num_mremaps_before = ppool->get_stats().num_mremap_calls;
+
+    const int* const old_data = v.data();
+    v.push_back(v[0]);
+    v.reserve(8 * n);
+    v.resize(8 * n + 1, v[1]);
+
+    const ParanoiaPool::Stats s = ppool->get_stats();
+    cout << "num_mremap_calls = " << (s.num_mremap_calls - num_mremaps_before) << endl;
+    cout << "v.size() = " << v.size() << endl;
+
+    assert(s.num_mremap_calls - num_mremaps_before >= 2);
+    assert(v.data() != old_data);
+    assert(ppool->owns(old_data));
+    assert(v.size() == 8 * n + 1);
+
+    for (size_t i = 0; i < n; ++i) {
+        assert(v[i] == int(i));
+    }
+    assert(v[n] == 0);
+    assert(v[8 * n] == 1);
+}
+
+void test20() {
+    cout << endl;
+
+    const size_t huge_page_size = get_huge_page_size();
+    if (huge_page_size == 0) {
+        cout << "No transparent huge page support; skipping." << endl;
+        return;
+    }
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+
+    // Off unless asked for.
+    const size_t num_bytes = 2 * huge_page_size + 4096;
+    void* plain = ppool->allocate(num_bytes);
+    assert(ppool->get_stats().num_huge_page_allocs == 0);
+    ppool->deallocate(plain);
+
+    ppool->set_huge_page_min_bytes(huge_page_size);
+    ppool->set_huge_page_collapse(true);
+
+    // Rounded up to whole huge pages, on a huge-page boundary.
+    char* p = static_cast<char*>(ppool->allocate(num_bytes));
+    assert(reinterpret_cast<uintptr_t>(p) % huge_page_size == 0);
+
+    std::fill(p, p + num_bytes, 'x');
+
+    // Small allocations are unaffected.
+    void* q = ppool->allocate(4096);
+
+    ParanoiaPool::Stats s = ppool->get_stats();
+    cout << "s.huge_page_alloc_bytes = " << s.huge_page_alloc_bytes << endl;
+    cout << "s.huge_page_backed_bytes = " << s.huge_page_backed_bytes << endl;
+
+    assert(s.num_huge_page_allocs == 1);
+    assert(s.huge_page_alloc_bytes == 3 * huge_page_size);
+    assert(s.huge_page_backed_bytes <= s.huge_page_alloc_bytes);
+
+    ppool->deallocate(p);
+    ppool->deallocate(q);
+
+    s = ppool->get_stats();
+    assert(s.num_huge_page_allocs == 0);
+    assert(s.huge_page_alloc_bytes == 0);
+    assert(s.huge_page_backed_bytes == 0);
+}
+
+void test21() {
+    cout << endl;
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+    auto allocator = std::make_shared<paranoia_allocator<int>>(ppool);
+
+    paranoid_vector<int> v(allocator);
+    for (int i = 0; i < 10000; ++i) {
+        v.push_back(i);
+    }
+
+    const paranoid_vector<int> & cv = v;
+    const int* const old_data = cv.data();
+
+    // Snapshots and their copies share the (now read-only) buffer.
+    paranoid_vector<int> s = v.snapshot();
+    const paranoid_vector<int> s2 = s;
+    assert(s2.data() == old_data);
+    assert(ppool->get_prot(const_cast<int*>(old_data)) == PROT_READ);
+
+    // The first write gives v its own copy.
+    v[0] = -1;
+    assert(cv.data() != old_data);
+    assert(s2.data() == old_data);
+    assert(s2[0] == 0);
+    assert(s2.size() == 10000);
+    assert(s2[9999] == 9999);
+
+    // A write through a raw pointer into the shared buffer faults.
+    const pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        *const_cast<volatile int*>(s2.data()) = 1;
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid);
+
+    cout << "child terminated by signal " << (WIFSIGNALED(status) ? WTERMSIG(status) : 0) << endl;
+    assert(WIFSIGNALED(status));
+    assert(WTERMSIG(status) == SIGSEGV);
+
+    s.push_back(10000);
+    assert(s.data() != old_data);
+    assert(s2.data() == old_data);
+
+    const paranoid_vector<int> & cs = s;
+    const int* const s_data = cs.data();
+
+    {
+        paranoid_vector<int> t = s.snapshot();
+        assert(t.size() == 10001);
+        assert(ppool->get_prot(const_cast<int*>(s_data)) == PROT_READ);
+    }
+
+    // Once the other sharer is gone, s takes the buffer back without copying.
+    s[1] = -2;
+    assert(ppool->get_prot(const_cast<int*>(s_data)) == (PROT_READ | PROT_WRITE));
+    assert(cs.data() == s_data);
+    assert(s.size() == 10001);
+    assert(s[0] == 0);
+    assert(s[1] == -2);
+    assert(s[10000] == 10000);
+
+    // Elements with destructors are destroyed once, by the last sharer.
+    paranoid_vector<std::string> strings;
+    strings.push_back("abc");
+    strings.push_back(std::string(100, 'x'));
+
+    paranoid_vector<std::string> string_snapshot = strings.snapshot();
+    strings.clear();
+    assert(strings.empty());
+    assert(string_snapshot.size() == 2);
+    assert(string_snapshot[0] == "abc");
+    string_snapshot.push_back("def");
+    assert(string_snapshot[2] == "def");
+
+    // Non-const accessors may have to copy, so they can throw.  Reading
+    // through the const ones never unshares.
+    static_assert(! noexcept(std::declval<paranoid_vector<int>&>().begin()), "begin() can unshare");
+    static_assert(! noexcept(std::declval<paranoid_vector<int>&>().data()), "data() can unshare");
+    static_assert(noexcept(std::declval<paranoid_vector<int>&>().cbegin()), "cbegin() never unshares");
+
+    paranoid_vector<int> reader = s.snapshot();
+    const int* const shared_data = cs.data();
+    assert(std::accumulate(reader.cbegin(), reader.cend(), 0LL) == std::accumulate(cs.begin(), cs.end(), 0LL));
+    assert(ppool->get_prot(const_cast<int*>(shared_data)) == PROT_READ);
+}
+
+void test22() {
+    cout << endl;
+
+    using checked_vector = paranoid_vector<int, paranoia_concurrency_checks<paranoia_full_checks>>;
+
+    // Nested mutating calls on one thread, and separate vectors on separate
+    // threads, are fine.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([t]() {
+            checked_vector v;
+            for (int i = 0; i < 1000; ++i) {
+                v.push_back(i);
+            }
+
+            v.insert(v.begin() + 10, {t, t, t});
+            v.erase(v.begin(), v.begin() + 5);
+
+            checked_vector w = v.snapshot();
+            w[0] = t;
+            v = w;
+            v.swap(w);
+            w = std::move(v);
+            w.assign(w.cbegin(), w.cend());
+            w.resize(10);
+            assert(w[0] == t);
+        });
+    }
+
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    // The child mutates one vector from two threads at once, which should
+    // abort it.
+    const pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        checked_vector v;
+
+        auto mutate = [&v]() {
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (std::chrono::steady_clock::now() < deadline) {
+                for (int i = 0; i < 1000; ++i) {
+                    v.push_back(i);
+                }
+                v.clear();
+            }
+        };
+
+        std::thread other(mutate);
+        mutate();
+        other.join();
+        _exit(0);
+    }
+
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid);
+
+    cout << "child terminated by signal " << (WIFSIGNALED(status) ? WTERMSIG(status) : 0) << endl;
+    assert(WIFSIGNALED(status));
+    assert(WTERMSIG(status) == SIGABRT);
+}
+
+void test23() {
+    cout << endl;
+
+    auto ppool = std::make_shared<ParanoiaPool>(1000*1000*1000, 100);
+    ppool->set_parallel_min_bytes(64 * 1024);
+
+    cout << "paranoia_parallel_num_threads() = " << paranoia_parallel_num_threads() << endl;
+
+    // Sizes that don't divide evenly into pages or chunks.
+    const size_t n = 3 * 1024 * 1024 + 7;
+
+    auto allocator = std::make_shared<paranoia_allocator<int>>(ppool);
+    paranoid_vector<int> v(allocator);
+
+    v.resize(n, 5);
+    v.resize(2 * n);
+    v.reserve(5 * n);
+
+    paranoid_vector<int> w(allocator);
+    w = v;
+
+    assert(w.size() == 2 * n);
+    for (size_t i = 0; i < 2 * n; ++i) {
+        assert(w[i] == ((i < n) ? 5 : 0));
+    }
+
+    // Not trivially copyable, but nothing throws.
+    using elem = std::pair<int, size_t>;
+    auto pair_allocator = std::make_shared<paranoia_allocator<elem>>(ppool);
+    paranoid_vector<elem> p(pair_allocator);
+
+    p.resize(n, elem(1, 2));
+    for (size_t i = 0; i < n; ++i) {
+        p[i].second = i;
+    }
+
+    p.reserve(3 * n);
+    p.resize(2 * n);
+
+    const paranoid_vector<elem> q = p;
+    for (size_t i = 0; i < 2 * n; ++i) {
+        assert(q[i] == ((i < n) ? elem(1, i) : elem(0, 0)));
+    }
+}
+
+void test24() {
+    cout << endl;
+
+    using checked_vector = paranoid_vector<int, paranoia_checked_iterators<paranoia_full_checks>>;
+
+    checked_vector v;
+    for (int i = 0; i < 1000; ++i) {
+        v.push_back(1000 - i);
+    }
+
+    std::sort(v.begin(), v.end());
+    assert(std::is_sorted(v.cbegin(), v.cend()));
+    assert(*std::find(v.cbegin(), v.cend(), 500) == 500);
+    assert(*v.rbegin() == 1000);
+
+    // Growing within capacity, swapping and moving don't invalidate anything.
+    v.reserve(2000);
+    checked_vector::const_iterator i = v.cbegin() + 10;
+    v.push_back(0);
+    assert(*i == 11);
+
+    checked_vector w;
+    w.swap(v);
+    assert(*i == 11);
+
+    checked_vector x(std::move(w));
+    assert(*i == 11);
+
+    // These all hand back fresh iterators.
+    checked_vector::iterator j = x.insert(x.cbegin() + 1, 7);
+    assert(*j == 7);
+    j = x.erase(j);
+    assert(*j == 2);
+    assert(x.end() - x.begin() == 1001);
+
+    // Dereferencing an iterator after a reallocation, or after its vector is
+    // destroyed, aborts.
+    for (int child = 0; child < 2; ++child) {
+        const pid_t pid = fork();
+        assert(pid >= 0);
+
+        if (pid == 0) {
+            auto y = std::make_unique<checked_vector>(x);
+            const checked_vector::iterator k = y->begin();
+            if (child == 0) {
+                y->shrink_to_fit();
+                y->resize(10 * y->size());
+            }
+            else {
+                y.reset();
+            }
+
+            cout << *k << endl;
+            _exit(0);
+        }
+
+        int status = 0;
+        assert(waitpid(pid, &status, 0) == pid);
+
+        cout << "child terminated by signal " << (WIFSIGNALED(status) ? WTERMSIG(status) : 0) << endl;
+        assert(WIFSIGNALED(status));
+        assert(WTERMSIG(status) == SIGABRT);
+    }
+}
+
 int main() {
     //test1();
     //test2();
     //test3();
     //test4();
     test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
+    test22();
+    test23();
+    test24();
 }
@@ -1,11 +1,21 @@
 #include "util.h"
 
+#include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 std::ostream& operator<<(std::ostream& os, const HexPtr ap) {
@@ -36,3 +46,75 @@ size_t get_page_size()
 
     return checked_cast<size_t>(val);
 }
+
+size_t get_huge_page_size()
+{
+    ifstream in("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+
+    size_t x = 0;
+    if (! (in >> x)) {
+        return 0;
+    }
+
+    return x;
+}
+
+void paranoia_bulk_copy(void* dst, const void* src, size_t num_bytes)
+{
+    if (num_bytes >= PARANOIA_STREAMING_COPY_MIN_BYTES) {
+        // A big destination is usually freshly mapped, and taking one page
+        // fault per page costs more than the copy itself.  Fault them all in
+        // with one call instead.  Older kernels don't know this advice, which
+        // is harmless.
+        const uintptr_t page_size = get_page_size();
+        const uintptr_t begin = (reinterpret_cast<uintptr_t>(dst) + page_size - 1) & ~(page_size - 1);
+        const uintptr_t end = (reinterpret_cast<uintptr_t>(dst) + num_bytes) & ~(page_size - 1);
+        if (begin < end) {
+            madvise(reinterpret_cast<void*>(begin), end - begin, MADV_POPULATE_WRITE);
+        }
+    }
+
+#if defined(__SSE2__)
+    if (num_bytes >= PARANOIA_STREAMING_COPY_MIN_BYTES) {
+        const size_t line_bytes = 64;
+
+        char* d = static_cast<char*>(dst);
+        const char* s = static_cast<const char*>(src);
+
+        // Streaming stores want an aligned destination.  Our buffers are
+        // page-aligned anyway, so this is normally a no-op.
+        const size_t head_bytes = (line_bytes - (reinterpret_cast<uintptr_t>(d) % line_bytes)) % line_bytes;
+        memcpy(d, s, head_bytes);
+        d += head_bytes;
+        s += head_bytes;
+        num_bytes -= head_bytes;
+
+        for (size_t i = 0; i < num_bytes / line_bytes; ++i) {
+            const __m128i* const in = reinterpret_cast<const __m128i*>(s);
+            __m128i* const out = reinterpret_cast<__m128i*>(d);
+
+            const __m128i x0 = _mm_loadu_si128(in);
+            const __m128i x1 = _mm_loadu_si128(in + 1);
+            const __m128i x2 = _mm_loadu_si128(in + 2);
+            const __m128i x3 = _mm_loadu_si128(in + 3);
+
+            _mm_stream_si128(out, x0);
+            _mm_stream_si128(out + 1, x1);
+            _mm_stream_si128(out + 2, x2);
+            _mm_stream_si128(out + 3, x3);
+
+            d += line_bytes;
+            s += line_bytes;
+        }
+
+        // Streaming stores are weakly ordered; make them visible before anyone
+        // reads the new buffer.
+        _mm_sfence();
+
+        memcpy(d, s, num_bytes % line_bytes);
+        return;
+    }
+#endif
+
+    memcpy(dst, src, num_bytes);
+}